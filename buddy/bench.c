@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buddy.h"
+
+#define PAGE (1024 * 4)
+#define POOLRANK (16)
+#define POOLPAGE (1 << (POOLRANK - 1))
+#define ROUNDS (1 << 20)
+#define REPEAT (5)
+
+static void *pool;
+static void *pages[POOLPAGE];
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Fill the pool with single pages and return every `stride`-th page,
+ * leaving free blocks of rank 1 only. */
+static void fragment(int stride) {
+    init_page(pool, POOLPAGE);
+    for (int i = 0; i < POOLPAGE; ++i) pages[i] = alloc_pages(1);
+    for (int i = 0; i < POOLPAGE; i += stride) return_pages(pages[i]);
+}
+
+/* High-rank requests against a pool with only rank 1 blocks left:
+ * every call scans all ranks above the request and fails. */
+static double bench_fail(void) {
+    fragment(2);
+    double t = now_ns();
+    for (long i = 0; i < ROUNDS; ++i) alloc_pages(2 + i % (POOLRANK - 1));
+    return (now_ns() - t) / ROUNDS;
+}
+
+/* Ping-pong of a single page while the low ranks are drained, so that
+ * each allocation finds the only free block at the top rank. */
+static double bench_drained(void) {
+    init_page(pool, POOLPAGE);
+    double t = now_ns();
+    for (long i = 0; i < ROUNDS; ++i) return_pages(alloc_pages(1));
+    return (now_ns() - t) / ROUNDS;
+}
+
+/* The same ping-pong with merges deferred: the page stays at rank 1
+ * instead of being merged up and split down again on every round. */
+static double bench_drained_lazy(void) {
+    lazy_config(1024);
+    double t = bench_drained();
+    lazy_config(0);
+    return t;
+}
+
+/* Ping-pong of a single page in a fragmented pool whose rank 1 list is
+ * never empty, the common case for page churn. */
+static double bench_churn(void) {
+    fragment(2);
+    double t = now_ns();
+    for (long i = 0; i < ROUNDS; ++i) return_pages(alloc_pages(1));
+    return (now_ns() - t) / ROUNDS;
+}
+
+/* Mid-rank requests in a pool where half of the pages are held in
+ * scattered single pages, forcing searches across partially used ranks. */
+static double bench_mixed(void) {
+    fragment(4);
+    for (int i = 0; i < POOLPAGE / 2; i += 4) {
+        for (int j = 1; j < 4; ++j) return_pages(pages[i + j]);
+    }
+    double t = now_ns();
+    for (long i = 0; i < ROUNDS; ++i) {
+        void *r = alloc_pages(1 + i % 4);
+        if (!IS_ERR(r)) return_pages(r);
+    }
+    return (now_ns() - t) / ROUNDS;
+}
+
+static double bench_mixed_lazy(void) {
+    lazy_config(1024);
+    double t = bench_mixed();
+    lazy_config(0);
+    return t;
+}
+
+/* Bursts of single page allocations followed by frees of the same pages,
+ * optionally served by the per-thread page cache (1) or the lock-free page
+ * stack (2). */
+static double burst(int cached) {
+    init_page(pool, POOLPAGE);
+    if (cached == 1) pcp_config(64, 16, 16);
+    if (cached == 2) lockfree_config(64, 16);
+    double t = now_ns();
+    for (long i = 0; i < ROUNDS; i += 64) {
+        for (int j = 0; j < 32; ++j) pages[j] = alloc_pages(1);
+        for (int j = 0; j < 32; ++j) return_pages(pages[j]);
+    }
+    t = now_ns() - t;
+    pcp_drain();
+    pcp_config(0, 0, 0);
+    lockfree_config(0, 0);
+    return t / ROUNDS;
+}
+
+static double bench_burst(void) {
+    return burst(0);
+}
+
+static double bench_burst_pcp(void) {
+    return burst(1);
+}
+
+static double bench_burst_lf(void) {
+    return burst(2);
+}
+
+/* Allocate and free 1024 pages of a rank per round, page by page or in
+ * bulk, reported per page. */
+static double batch(int rank, int bulk) {
+    const int n = 1024;
+    init_page(pool, POOLPAGE);
+    double t = now_ns();
+    for (long i = 0; i < ROUNDS; i += n) {
+        if (bulk) {
+            alloc_pages_bulk(rank, n, pages);
+            return_pages_bulk(pages, n);
+        } else {
+            for (int j = 0; j < n; ++j) pages[j] = alloc_pages(rank);
+            for (int j = 0; j < n; ++j) return_pages(pages[j]);
+        }
+    }
+    return (now_ns() - t) / ROUNDS;
+}
+
+static double bench_loop(void) {
+    return batch(1, 0);
+}
+
+static double bench_bulk(void) {
+    return batch(1, 1);
+}
+
+static double bench_loop4(void) {
+    return batch(4, 0);
+}
+
+static double bench_bulk4(void) {
+    return batch(4, 1);
+}
+
+/* Age the pool with movable blocks of ranks 1-3 replaced at random while an
+ * unmovable page is pinned every 64 allocations, then free the movable blocks
+ * and count the rank 10 blocks that can still be allocated. */
+static int aging(int pageblock_rank) {
+    const int live = 4096, pins = 256;
+    void **pinned = pages + live;
+    unsigned seed = 1;
+    int pinned_num = 0, got = 0;
+    init_page(pool, POOLPAGE);
+    mobility_config(pageblock_rank);
+    for (int i = 0; i < live; ++i) pages[i] = alloc_pages_type(1 + i % 3, PAGE_MOVABLE);
+    for (long i = 0; i < ROUNDS; ++i) {
+        int k = rand_r(&seed) % live;
+        if (!IS_ERR(pages[k])) return_pages(pages[k]);
+        pages[k] = alloc_pages_type(1 + rand_r(&seed) % 3, PAGE_MOVABLE);
+        if (i % 64 == 0 && pinned_num < pins) pinned[pinned_num++] = alloc_pages(1);
+    }
+    for (int i = 0; i < live; ++i)
+        if (!IS_ERR(pages[i])) return_pages(pages[i]);
+    while (!IS_ERR(pages[got] = alloc_pages_type(10, PAGE_MOVABLE))) ++got;
+    mobility_config(0);
+    return got;
+}
+
+static int relocate(void *from, void *to, int rank, void *arg) {
+    (void)arg;
+    pages[*(int *)from] = to;
+    memcpy(to, from, (size_t)PAGE << (rank - 1));
+    return OK;
+}
+
+/* Allocate rank 5 blocks from a pool with every other page used, each tagged
+ * with its index in `pages`, until one fails. Return how many were allocated
+ * and store the time taken per block into `ns`. */
+static int compaction(int automatic, double *ns) {
+    static void *blocks[POOLPAGE / 16];
+    int n = 0;
+    fragment(2);
+    for (int i = 1; i < POOLPAGE; i += 2) *(int *)pages[i] = i;
+    compact_config(relocate, NULL, automatic);
+    double t = now_ns();
+    while (n < POOLPAGE / 16 && !IS_ERR(blocks[n] = alloc_pages(5))) ++n;
+    *ns = n? (now_ns() - t) / n: 0;
+    compact_config(NULL, NULL, 0);
+    return n;
+}
+
+/* Allocate bursts of 64 zeroed rank 4 blocks, freed again after use, with
+ * the allocating thread idle for a millisecond in between. Return the time
+ * per block spent allocating. */
+static double zeroed(long target) {
+    const int n = 64, rounds = 200;
+    double ns = 0;
+    init_page(pool, POOLPAGE);
+    prezero_config(target);
+    for (int i = 0; i < rounds; ++i) {
+        usleep(1000);
+        double t = now_ns();
+        for (int j = 0; j < n; ++j) pages[j] = alloc_pages_zeroed(4);
+        ns += now_ns() - t;
+        for (int j = 0; j < n; ++j) memset(pages[j], 1, PAGE * 8);
+        for (int j = 0; j < n; ++j) return_pages(pages[j]);
+    }
+    prezero_config(0);
+    return ns / (n * rounds);
+}
+
+/* Run a benchmark several times and report its best run. */
+static void run(const char *name, double (*bench)(void)) {
+    double best = bench();
+    for (int i = 1; i < REPEAT; ++i) {
+        double ns = bench();
+        if (ns < best) best = ns;
+    }
+    printf("%-28s %8.2f ns/op\n", name, best);
+}
+
+int main() {
+    pool = malloc((size_t)POOLPAGE * PAGE);
+    if (pool == NULL) return 1;
+    printf("Buddy microbenchmark (%d pages, %d rounds)\n", POOLPAGE, ROUNDS);
+    run("fail (rank 1 free only)", bench_fail);
+    run("drained (top rank only)", bench_drained);
+    run("drained (lazy merging)", bench_drained_lazy);
+    run("churn (rank 1 available)", bench_churn);
+    run("mixed (ranks 1-4)", bench_mixed);
+    run("mixed (lazy merging)", bench_mixed_lazy);
+    run("burst (no page cache)", bench_burst);
+    run("burst (page cache)", bench_burst_pcp);
+    run("burst (lock-free stack)", bench_burst_lf);
+    run("1024 x rank 1 (loop)", bench_loop);
+    run("1024 x rank 1 (bulk)", bench_bulk);
+    run("1024 x rank 4 (loop)", bench_loop4);
+    run("1024 x rank 4 (bulk)", bench_bulk4);
+
+    printf("\nrank 10 blocks left after aging with 256 pinned pages (of %d)\n",
+           POOLPAGE >> 9);
+    printf("%-28s %8d\n", "no grouping", aging(0));
+    printf("%-28s %8d\n", "grouping (pageblock rank 10)", aging(10));
+
+    double ns;
+    printf("\nrank 5 blocks from a pool with every other page used\n");
+    printf("%-28s %8d\n", "no compaction", compaction(0, &ns));
+    int n = compaction(1, &ns);
+    printf("%-28s %8d %8.0f ns/block\n", "automatic compaction", n, ns);
+
+    printf("\nbursts of 64 zeroed rank 4 blocks\n");
+    printf("%-28s %8.0f ns/block\n", "zeroed on allocation", zeroed(0));
+    printf("%-28s %8.0f ns/block\n", "zeroed in the background", zeroed(1024));
+    free(pool);
+    return 0;
+}
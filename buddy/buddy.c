@@ -1,16 +1,25 @@
 #include "buddy.h"
 
 // #include <stdio.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if __has_include(<sys/single_threaded.h>)
+#include <sys/single_threaded.h>
+#else
+// never known to be alone, every call takes the rank locks
+#define __libc_single_threaded 0
+#endif
 
-typedef unsigned long int size_t; 
-typedef unsigned char uint8_t;
-typedef unsigned int uint32_t;
 typedef char bool;
 #define true 1
 #define false 0
 
-#define NULL ((void *)0)
-
 #define PAGE_BITS (12u)
 #define PAGE_SIZE (1u << PAGE_BITS)
 
@@ -19,180 +28,2480 @@ typedef char bool;
 #define MIN_ALLOC_SIZE ((size_t) 1 << MIN_ALLOC_BITS)
 #define MAX_ALLOC_SIZE ((size_t) 1 << MAX_ALLOC_BITS)
 
-#define MAX_RANK_NUM 20u
-#define MAX_PAGE_NUM (1u << MAX_RANK_NUM)
+#define MAX_RANK_NUM ((unsigned)BUDDY_MAX_RANK)
+#define MAX_PAGE_NUM (1ull << (MAX_RANK_NUM - 1))
+#define MAX_FALLBACK 8
+#define MIGRATE_TYPES 2
+// a list per type for blocks of unknown contents, then one per type for zeroed ones
+#define FREE_LISTS (MIGRATE_TYPES * 2)
+#define MAX_RECLAIM 8
+#define MAX_REGIONS 64
+// how many times a region being removed is looked at, its pages moved out in between
+#define REMOVE_TRIES 3
+// the largest block zeroed in the background in one go, 1 MiB
+#define ZERO_RANK 9
+// how long the zeroing thread sleeps once it has nothing to do, in ms
+#define ZERO_POLL 10
+// features turned on, tested at once by calls that find them all off
+#define FEAT_PCP 1
+#define FEAT_LF 2
+#define FEAT_LAZY 4
+#define FEAT_WMARK 8
+#define FEAT_ZEROD 16
+// page index bits of the head of the lock-free page stack, the rest is its tag
+#define LF_PFN_BITS 40
+#define LF_PFN_MASK ((1ull << LF_PFN_BITS) - 1)
+#define LF_TAG (1ull << LF_PFN_BITS)
+// levels of summary above a rank's free bits, 64^7 covers 2^39 blocks
+#define SUM_LEVELS 7
+
+// page indices are 64-bit, regions may hold far more than 2^32 pages
+typedef uint64_t pfn_t;
 
-#define UNDEF 0
-#define UNUSED 1
-#define USED 2 
+// set while the calling thread runs a call as the only thread of the process
+static __thread bool solo;
+
+// updates of words shared with other threads, plain while the caller is alone
+#define SHARED_OR(p, v) \
+    (solo? (void)(*(p) |= (v)): (void)__atomic_or_fetch(p, v, __ATOMIC_RELAXED))
+#define SHARED_AND(p, v) \
+    (solo? (void)(*(p) &= (v)): (void)__atomic_and_fetch(p, v, __ATOMIC_RELAXED))
+#define SHARED_ADD(p, v) \
+    (solo? (void)(*(p) += (v)): (void)__atomic_add_fetch(p, v, __ATOMIC_RELAXED))
 
 typedef struct list_t list_t;
 
+// free-list links, stored in the first bytes of every free block
 struct list_t {
-    uint8_t status;
-    uint8_t rank;
-    uint32_t index; 
     list_t *prev, *next;
 };
 
-#define LIST_INITIALIZER ((list_t){UNDEF, 0, 0, NULL, NULL})
-
-#define list_remove(list, node) do { \
+// every macro below keeps `free_mask[list]` in sync with the emptiness of `bucket[rank][list]`
+#define list_remove(pool, rank, list, node) do { \
     if ((node) != NULL) { \
         if ((node)->next != NULL) (node)->next->prev = (node)->prev; \
         if ((node)->prev != NULL) (node)->prev->next = (node)->next; \
     } \
-    if ((node) == (list)) (list) = (node)->next; \
-} while(0) 
-
-#define list_pop(list) do { \
-    if ((list) == NULL) return NULL; \
-    if ((list)->next != NULL) (list)->next->prev = NULL; \
-    (list) = (list)->next; \
+    if ((node) == (pool)->bucket[rank][list]) (pool)->bucket[rank][list] = (node)->next; \
+    if ((pool)->bucket[rank][list] == NULL) \
+        SHARED_AND(&(pool)->free_mask[list], ~(1ull << (rank))); \
 } while(0)
 
-#define list_push(list, node) do { \
+#define list_push(pool, rank, list, node) do { \
     (node)->prev = NULL; \
-    (node)->next = list; \
-    if ((list) != NULL) (list)->prev = (node); \
-    (list) = (node); \
+    (node)->next = (pool)->bucket[rank][list]; \
+    if ((pool)->bucket[rank][list] != NULL) (pool)->bucket[rank][list]->prev = (node); \
+    else SHARED_OR(&(pool)->free_mask[list], 1ull << (rank)); \
+    (pool)->bucket[rank][list] = (node); \
 } while(0)
 
-static void *base_ptr;
-static uint32_t rank_num;
-#define page_num (1u << (rank_num - 1))
+typedef struct pcp_t pcp_t;
+typedef struct reclaim_t reclaim_t;
+typedef struct region_t region_t;
+
+// pages [start, end) of a pool that were added to it
+struct region_t {
+    pfn_t start, end;
+};
+
+// a low-memory callback, asked to free `pages` pages and returning how many it did
+struct reclaim_t {
+    long (*fn)(long pages, void *arg);
+    void *arg;
+};
+
+/*
+ * Rank 1 pages may in addition be cached per thread: a cache is refilled with
+ * `pcp_batch` pages when empty, and drained down to `pcp_low` pages once it
+ * holds more than `pcp_high`, so rank_lock[1] is taken once per batch rather
+ * than once per page. Caching is off while `pcp_high` is 0.
+ *
+ * They may also be kept on a lock-free stack shared by all threads, a Treiber
+ * stack: `lf_head` packs the index of the top page plus one, 0 when empty, into
+ * its low LF_PFN_BITS bits and a tag bumped by every push and pop into the
+ * rest, so a head read before another thread pops the page and pushes it back
+ * no longer matches (ABA). Each stacked page links to the next the same way in
+ * its first word; a popping thread may read the link of a page just taken by
+ * another, which is harmless as its exchange then fails. The stack is refilled
+ * with `lf_batch` pages under one rank lock when empty, and drained by as many
+ * once it holds more than `lf_high`. Per-thread caches refill from it and
+ * drain into it first. It is off while `lf_high` is 0.
+ */
+struct pcp_t {
+    list_t *list;
+    uint32_t count;
+    buddy_pool_t *pool;
+    pcp_t *prev, *next;
+};
+
+/*
+ * A pool manages one region of `page_num` pages starting at `base_ptr`, seeded
+ * with the maximal aligned blocks covering it. Blocks of the top rank `rank_num`
+ * are roots, smaller blocks in the tail of the region descend from roots that
+ * straddle its end (see seal_tail).
+ *
+ * Locking. bucket[r][*], count[r] and the free bits of rank r are guarded by
+ * rank_lock[r]. A thread holds at most one rank lock at a time, except that a
+ * per-thread cache drain keeps rank_lock[1] while it merges upwards, so locks
+ * are only ever nested in increasing rank order. A block removed from a free
+ * list belongs to the thread that removed it until it is pushed again, so the
+ * split bits and order bytes of a block are written by its owner only.
+ * Bitmap words are shared by neighbouring blocks and thus updated atomically.
+ * A call made while the process has a single thread takes no rank lock and
+ * updates shared words with plain stores instead, `solo` telling so until it
+ * returns, so that a split or merge chain costs no locked instruction per
+ * level. The process only grows threads, and only the calling thread may
+ * start one, which callbacks run by a call must thus not do.
+ *
+ * Page metadata. Block i of rank r covers pages [i << (r - 1), (i + 1) << (r - 1)),
+ * and owns bit `map_off[r] + i` of each bitmap:
+ *   split_map - the block is divided into two blocks of rank r - 1
+ *   free_map  - the block is free, i.e. linked in a list of bucket[r]
+ *   zero_map  - the block is free and holds zeroes only, but for its links
+ * A block exists iff all of its ancestors are split. Bits of blocks that do not
+ * exist are stale and never trusted, so (re)initialization only writes the root.
+ * The zero bit is only trusted for free blocks, and written whenever one is
+ * pushed. order[page] records the rank of the block headed by `page` when it
+ * was last allocated or freed. Its high bits tell free blocks, and those held
+ * by a per-thread cache, being zeroed or missing from the pool, from used ones
+ * without touching the bitmaps. A bare rank marks the head of a used block
+ * and nothing else: the bytes of heads swallowed by a merge are cleared, and
+ * all of them whenever pages enter the pool, so a free is checked in one load.
+ * Other bytes are hints to be validated against the bitmaps.
+ *
+ * Lazy merging. With `lazy_limit` set, a freed block is put into its own free
+ * list without looking at its buddy, so two free buddies may coexist. They are
+ * coalesced by a sweep over all free lists once `lazy_limit` frees have been
+ * deferred, or before an allocation would fail for want of a large block.
+ *
+ * Address order. Ranks set in `addr_mask` hand out their lowest free block
+ * rather than the most recently freed one. For those ranks the free bits are
+ * kept exact, stale bits being cleared when the policy is set up, and summed
+ * up in levels: bit i of level l + 1 is set iff word i of level l is non-zero,
+ * level 0 being the free bits themselves. The top level is a single word, so
+ * the lowest free block is found in one ctz per level. Summaries of rank r are
+ * guarded by rank_lock[r] like its free bits.
+ *
+ * Mobility grouping. With `pb_rank` set, the region is divided into pageblocks
+ * of that rank, each of a type, PAGE_UNMOVABLE or PAGE_MOVABLE, kept in
+ * `pb_type`. Every free block is linked in the list of its rank and of the type
+ * of its first pageblock, and allocations of a type are served from the lists
+ * of the type. Only when they run dry is a block of another type taken, the
+ * largest one so as to mix types in as few pageblocks as possible, and if it
+ * spans whole pageblocks those handed out are turned over to the new type.
+ * The type of a pageblock only changes while all of it is owned by the thread
+ * changing it, so the list a free block is linked in is always that of its
+ * first pageblock. Without grouping every block is of type 0.
+ *
+ * Watermarks. `free_pages` is adjusted once per allocation or free rather
+ * than per block pushed or removed. Once an allocation leaves fewer than
+ * `wmark_low` pages free, the reclaim callbacks are run until `wmark_high` are,
+ * by the allocating thread or by a background thread it wakes up. Below
+ * `wmark_min` the allocating thread runs them itself before allocating. Only
+ * one thread runs them at a time, and watermarks are off while `wmark_low` is 0.
+ *
+ * Zeroed blocks. A free block known to be zeroed is linked in the list of its
+ * type offset by MIGRATE_TYPES, and stays zeroed when split or merged with a
+ * zeroed buddy; merged with any other it is not. Plain allocations take blocks
+ * of unknown contents first and zeroed allocations zeroed ones, clearing the
+ * block themselves only if there is none. Pages freed by their user are of
+ * unknown contents. With `zero_target` set, a background thread takes blocks
+ * of unknown contents off the lists, clears them with streaming stores that
+ * leave the caches alone and frees them as zeroed, until that many free pages
+ * are zeroed. Such a block is not merged with a free buddy of unknown contents,
+ * the merge being owed like a deferred one until a sweep. While a block is
+ * being cleared its pages count as used, and an allocation finding no free
+ * block waits for it rather than fail.
+ */
+struct buddy_pool {
+    void *base_ptr;
+    uint32_t rank_num;
+    pfn_t page_num;
+    // FEAT_* bits, each set while the setting it names is non-zero
+    uint32_t features;
+
+    pthread_mutex_t rank_lock[MAX_RANK_NUM + 1];
+    uint64_t count[MAX_RANK_NUM + 1];
+    list_t* bucket[MAX_RANK_NUM + 1][FREE_LISTS];
+    // bit i of free_mask[l] is set iff bucket[i][l] is non-empty
+    uint64_t free_mask[FREE_LISTS];
+    // blocks of each rank in the zeroed lists, guarded like count
+    uint64_t zero_count[MAX_RANK_NUM + 1];
+
+    uint64_t map_off[MAX_RANK_NUM + 2];
+    uint64_t *split_map;
+    uint64_t *free_map;
+    uint64_t *zero_map;
+    // zero bits are neither read nor written until a zeroing thread is first set up
+    bool zero_track;
+    uint8_t *order;
+    // pages the metadata is laid out for, and the ranks it has
+    pfn_t meta_cap;
+    uint32_t meta_ranks;
+
+    // regions in address order and the pages they hold, guarded by region_lock
+    region_t region[MAX_REGIONS];
+    int region_num;
+    pfn_t present;
+    pthread_mutex_t region_lock;
+
+    uint32_t pcp_high, pcp_low, pcp_batch;
+    pthread_key_t pcp_key;
+    // every cache of this pool, guarded by pcp_lock
+    pthread_mutex_t pcp_lock;
+    pcp_t *pcp_list;
+
+    uint64_t lf_head;
+    uint32_t lf_high, lf_batch, lf_count;
+
+    // deferred coalescing is off while `lazy_limit` is 0
+    uint32_t lazy_limit;
+    uint32_t lazy_debt;
+
+    uint64_t addr_mask;
+    uint64_t *sum_map;
+    // word offset into sum_map of each summary level of each rank
+    uint64_t sum_off[MAX_RANK_NUM + 1][SUM_LEVELS + 1];
+    uint8_t sum_levels[MAX_RANK_NUM + 1];
+    size_t sum_cap;
+
+    // grouping by mobility is off while `pb_rank` is 0
+    uint8_t pb_rank;
+    uint8_t *pb_type;
+    pfn_t pb_cap;
+
+    // blocks divided or fused so far, and requests of each rank turned down
+    uint64_t splits, merges, steals, migrations;
+    uint64_t alloc_fails[MAX_RANK_NUM + 1];
+
+    int64_t free_pages;
+    long wmark_min, wmark_low, wmark_high;
+    // callbacks and the background thread are guarded by wmark_lock
+    reclaim_t reclaim[MAX_RECLAIM];
+    int reclaim_num;
+    int reclaiming;
+    pthread_mutex_t wmark_lock;
+    pthread_cond_t wmark_cond;
+    pthread_t reclaimd;
+    bool reclaimd_on, reclaimd_stop, reclaimd_wake;
+    uint64_t reclaims, reclaimed;
+
+    // the zeroing thread is off while `zero_target` is 0, guarded by zero_lock
+    long zero_target;
+    pthread_mutex_t zero_lock;
+    pthread_cond_t zero_cond;
+    pthread_t zerod;
+    bool zerod_on, zerod_stop;
+    // odd while the thread holds a block it took to zero, waited for on zero_cond
+    uint32_t zeroing;
+    // pages zeroed in the background, and by zeroed allocations on the spot
+    uint64_t prezeroed, zero_fills;
+
+    // moves a used block for compaction, which is off while it is NULL
+    int (*migrate)(void *from, void *to, int rank, void *arg);
+    void *migrate_arg;
+    // compact and retry when a request of rank 2 or above fails
+    bool compact_auto;
+    // where the next compaction starts looking, guarded by compact_lock
+    pfn_t compact_next;
+    pthread_mutex_t compact_lock;
+
+    // pools to allocate from, in order, when this one is exhausted
+    buddy_pool_t *fallback[MAX_FALLBACK];
+    int fallback_num;
+};
+
+#define ORDER_RANK(o) ((o) & 0x3f)
+#define ORDER_FREE 0x40
+// held by a per-thread cache or the zeroing thread, or a hole
+#define ORDER_CACHED 0x80
 
-static uint32_t count[MAX_RANK_NUM + 1];
-static list_t* bucket[MAX_RANK_NUM + 1];
-static list_t meta[MAX_PAGE_NUM];
+// read without the rank locks, it only grows as regions are added
+#define RANK_NUM(pool) __atomic_load_n(&(pool)->rank_num, __ATOMIC_RELAXED)
+// the settings of a feature are stored before its bit is set
+#define FEATURES(pool) __atomic_load_n(&(pool)->features, __ATOMIC_ACQUIRE)
 
-static uint8_t _log2(uint32_t num) {
+#define BIT(pool, rank, index) ((pool)->map_off[rank] + (index))
+#define TEST_BIT(map, bit) \
+    ((__atomic_load_n(&(map)[(bit) >> 6], __ATOMIC_RELAXED) >> ((bit) & 63)) & 1)
+#define SET_BIT(map, bit) SHARED_OR(&(map)[(bit) >> 6], 1ull << ((bit) & 63))
+#define CLEAR_BIT(map, bit) SHARED_AND(&(map)[(bit) >> 6], ~(1ull << ((bit) & 63)))
+
+static buddy_pool_t default_pool;
+
+static void lock_rank(buddy_pool_t *pool, uint8_t rank) {
+    if (!solo) pthread_mutex_lock(&pool->rank_lock[rank]);
+}
+
+static void unlock_rank(buddy_pool_t *pool, uint8_t rank) {
+    if (!solo) pthread_mutex_unlock(&pool->rank_lock[rank]);
+}
+
+/*
+ * Start a call that takes rank locks, alone if the process has a single
+ * thread, unless the thread is so already. Return whether it went alone, to
+ * be passed to solo_leave.
+ */
+static bool solo_enter(void) {
+    if (solo || !__libc_single_threaded) return false;
+    solo = true;
+    return true;
+}
+
+static void solo_leave(bool held) {
+    if (held) solo = false;
+}
+
+static void set_feature(buddy_pool_t *pool, uint32_t feature, bool on) {
+    if (on) __atomic_or_fetch(&pool->features, feature, __ATOMIC_RELEASE);
+    else __atomic_and_fetch(&pool->features, ~feature, __ATOMIC_RELEASE);
+}
+
+static uint8_t _log2(uint64_t num) {
     if (num == 0) return -1;
-    uint8_t ret = 0;
-    for (; num > 1; num >>= 1) ret++;
+    return 63 - __builtin_clzll(num);
+}
+
+static void* page_to_ptr(buddy_pool_t *pool, pfn_t page) {
+    return pool->base_ptr + (size_t)page * PAGE_SIZE;
+}
+
+static bool is_valid_ptr(buddy_pool_t *pool, void *ptr) {
+    if (pool->base_ptr == NULL || ptr < pool->base_ptr) return false;
+    if ((ptr - pool->base_ptr) % PAGE_SIZE != 0) return false;
+    // regions may be added meanwhile, the pages past the old end are metadata first
+    return (pfn_t)(ptr - pool->base_ptr) / PAGE_SIZE < __atomic_load_n(&pool->page_num, __ATOMIC_ACQUIRE);
+}
+
+static pfn_t ptr_to_page(buddy_pool_t *pool, void *ptr) {
+    return (pfn_t)(ptr - pool->base_ptr) / PAGE_SIZE;
+}
+
+// whether `page` heads an existing (free or used) block of `rank`
+static bool is_block(buddy_pool_t *pool, pfn_t page, uint32_t rank) {
+    uint32_t rank_num = __atomic_load_n(&pool->rank_num, __ATOMIC_ACQUIRE);
+    if (rank < 1 || rank > rank_num) return false;
+    pfn_t index = page >> (rank - 1);
+    if (index << (rank - 1) != page) return false;
+    if (TEST_BIT(pool->split_map, BIT(pool, rank, index))) return false;
+    for (; rank < rank_num; ++rank) {
+        index >>= 1;
+        if (!TEST_BIT(pool->split_map, BIT(pool, rank + 1, index))) return false;
+    }
+    return true;
+}
+
+// whether `page` heads a used block of `rank`, told by its order byte alone
+static bool is_used(buddy_pool_t *pool, pfn_t page, uint32_t rank) {
+    return rank >= 1 && rank <= RANK_NUM(pool) && pool->order[page] == rank;
+}
+
+#define ADDR_ORDERED(pool, rank) (((pool)->addr_mask >> (rank)) & 1)
+
+// the free list type of a block headed by `page`, that of its first pageblock
+static int block_type(buddy_pool_t *pool, pfn_t page) {
+    if (pool->pb_rank == 0) return 0;
+    return __atomic_load_n(&pool->pb_type[page >> (pool->pb_rank - 1)], __ATOMIC_RELAXED);
+}
+
+// whether the block of `rank` headed by `page` is marked zeroed
+static bool is_zero(buddy_pool_t *pool, pfn_t page, uint8_t rank) {
+    if (!__atomic_load_n(&pool->zero_track, __ATOMIC_ACQUIRE)) return false;
+    return TEST_BIT(pool->zero_map, BIT(pool, rank, page >> (rank - 1)));
+}
+
+// mark a block owned by the caller as zeroed or not, before it is pushed
+static void set_zero(buddy_pool_t *pool, pfn_t page, uint8_t rank, bool zero) {
+    if (!__atomic_load_n(&pool->zero_track, __ATOMIC_ACQUIRE)) return;
+    uint64_t bit = BIT(pool, rank, page >> (rank - 1));
+    if (!TEST_BIT(pool->zero_map, bit) == !zero) return;
+    if (zero) SET_BIT(pool->zero_map, bit);
+    else CLEAR_BIT(pool->zero_map, bit);
+}
+
+// the free list of a block headed by `page`, the zeroed one of its type if it is
+static int block_list(buddy_pool_t *pool, pfn_t page, uint8_t rank) {
+    return block_type(pool, page) + (is_zero(pool, page, rank)? MIGRATE_TYPES: 0);
+}
+
+/*
+ * Turn the pageblocks of [page, end) over to `type`, if they come from a block
+ * of rank `big` owned by the caller that spans whole pageblocks.
+ */
+static void claim_pageblocks(buddy_pool_t *pool, pfn_t page, pfn_t end, uint8_t big, int type) {
+    uint8_t pb_rank = pool->pb_rank;
+    if (pb_rank == 0 || big < pb_rank) return;
+    for (pfn_t pb = page >> (pb_rank - 1); pb <= (end - 1) >> (pb_rank - 1); ++pb)
+        __atomic_store_n(&pool->pb_type[pb], type, __ATOMIC_RELAXED);
+}
+
+// record in the summaries that the free bit of block `index` was set
+static void sum_set(buddy_pool_t *pool, uint8_t rank, pfn_t index) {
+    uint64_t word = index >> 6;
+    for (int l = 1; l <= pool->sum_levels[rank]; ++l) {
+        uint64_t *sum = &pool->sum_map[pool->sum_off[rank][l] + (word >> 6)];
+        uint64_t bit = 1ull << (word & 63);
+        if (*sum & bit) break;
+        *sum |= bit;
+        word >>= 6;
+    }
+}
+
+// record in the summaries that the free bit of block `index` was cleared
+static void sum_clear(buddy_pool_t *pool, uint8_t rank, pfn_t index) {
+    uint64_t word = index >> 6;
+    if (__atomic_load_n(&pool->free_map[(pool->map_off[rank] >> 6) + word], __ATOMIC_RELAXED))
+        return;
+    for (int l = 1; l <= pool->sum_levels[rank]; ++l) {
+        uint64_t *sum = &pool->sum_map[pool->sum_off[rank][l] + (word >> 6)];
+        *sum &= ~(1ull << (word & 63));
+        if (*sum != 0) break;
+        word >>= 6;
+    }
+}
+
+// the lowest free block of an address-ordered rank, which must not be empty
+static pfn_t lowest_block(buddy_pool_t *pool, uint8_t rank) {
+    uint64_t word = 0;
+    for (int l = pool->sum_levels[rank]; l >= 1; --l)
+        word = (word << 6) + __builtin_ctzll(pool->sum_map[pool->sum_off[rank][l] + word]);
+    uint64_t bits = __atomic_load_n(&pool->free_map[(pool->map_off[rank] >> 6) + word],
+                                    __ATOMIC_RELAXED);
+    return ((word << 6) + __builtin_ctzll(bits)) << (rank - 1);
+}
+
+/*
+ * The free block of `rank` in `list` to hand out next, with rank_lock[rank]
+ * held. The lowest block of an address-ordered rank is only handed out if it
+ * is in the list.
+ */
+static pfn_t first_block(buddy_pool_t *pool, uint8_t rank, int list) {
+    if (ADDR_ORDERED(pool, rank)) {
+        pfn_t page = lowest_block(pool, rank);
+        if (block_list(pool, page, rank) == list) return page;
+    }
+    return ptr_to_page(pool, pool->bucket[rank][list]);
+}
+
+// link a free block into the lists of `rank`, with rank_lock[rank] held
+static void push_block(buddy_pool_t *pool, pfn_t page, uint8_t rank) {
+    uint64_t bit = BIT(pool, rank, page >> (rank - 1));
+    CLEAR_BIT(pool->split_map, bit);
+    SET_BIT(pool->free_map, bit);
+    if (ADDR_ORDERED(pool, rank)) sum_set(pool, rank, page >> (rank - 1));
+    pool->order[page] = rank | ORDER_FREE;
+    list_t *node = page_to_ptr(pool, page);
+    int list = block_list(pool, page, rank);
+    list_push(pool, rank, list, node);
+    pool->count[rank]++;
+    // read without the lock by the zeroing thread
+    if (list >= MIGRATE_TYPES)
+        __atomic_store_n(&pool->zero_count[rank], pool->zero_count[rank] + 1, __ATOMIC_RELAXED);
+}
+
+// unlink a free block from the lists of `rank`, with rank_lock[rank] held
+static void remove_block(buddy_pool_t *pool, pfn_t page, uint8_t rank) {
+    CLEAR_BIT(pool->free_map, BIT(pool, rank, page >> (rank - 1)));
+    if (ADDR_ORDERED(pool, rank)) sum_clear(pool, rank, page >> (rank - 1));
+    list_t *node = page_to_ptr(pool, page);
+    int list = block_list(pool, page, rank);
+    list_remove(pool, rank, list, node);
+    pool->count[rank]--;
+    if (list >= MIGRATE_TYPES)
+        __atomic_store_n(&pool->zero_count[rank], pool->zero_count[rank] - 1, __ATOMIC_RELAXED);
+}
+
+// take a free block of exactly `rank` from `list`, or return -1
+static int64_t pop_block(buddy_pool_t *pool, uint8_t rank, int list) {
+    int64_t page = -1;
+    lock_rank(pool, rank);
+    if (pool->bucket[rank][list] != NULL) {
+        page = first_block(pool, rank, list);
+        remove_block(pool, page, rank);
+    }
+    unlock_rank(pool, rank);
+    return page;
+}
+
+/*
+ * Merge a used block with its free buddies and put the result into its free
+ * list, with rank_lock[rank] held by the caller, which is kept on return.
+ * Higher ranks are locked one at a time on the way up. With `keep` set, a
+ * zeroed block stops short of a buddy of unknown contents, leaving the merge
+ * owed as a deferred one.
+ */
+static void merge_block(buddy_pool_t *pool, pfn_t page, uint8_t rank, bool keep) {
+    uint8_t held = rank;
+    pfn_t index = page >> (rank - 1);
+    bool zero = is_zero(pool, page, rank);
+// printf("[dbg] page %d, rank %d\n", page, rank);
+    while (rank < pool->rank_num) {
+        pfn_t buddy = index ^ 1;
+        if (!TEST_BIT(pool->free_map, BIT(pool, rank, buddy))) break;
+        if (zero && keep && !is_zero(pool, buddy << (rank - 1), rank)) {
+            SHARED_ADD(&pool->lazy_debt, 1);
+            break;
+        }
+        zero = zero && is_zero(pool, buddy << (rank - 1), rank);
+        remove_block(pool, buddy << (rank - 1), rank);
+        if (rank != held) unlock_rank(pool, rank);
+        // the upper head is swallowed by the merged block, links and all
+        pool->order[(index | 1) << (rank - 1)] = 0;
+        if (zero) memset(page_to_ptr(pool, (index | 1) << (rank - 1)), 0, sizeof(list_t));
+        rank++;
+        index >>= 1;
+        lock_rank(pool, rank);
+    }
+    if (rank != held) set_zero(pool, index << (rank - 1), rank, zero);
+    push_block(pool, index << (rank - 1), rank);
+    if (rank != held) {
+        unlock_rank(pool, rank);
+        SHARED_ADD(&pool->merges, rank - held);
+    }
+}
+
+// account for `pages` pages becoming free, or used if negative
+static void account(buddy_pool_t *pool, int64_t pages) {
+    SHARED_ADD(&pool->free_pages, pages);
+}
+
+/*
+ * Put a used block into the free lists, with rank_lock[rank] held, merging it
+ * at once unless merges are deferred. `zero` tells whether it is zeroed.
+ */
+static void free_block(buddy_pool_t *pool, pfn_t page, uint8_t rank, bool zero) {
+    set_zero(pool, page, rank, zero);
+    account(pool, (int64_t)1 << (rank - 1));
+    if (!(FEATURES(pool) & FEAT_LAZY)) {
+        merge_block(pool, page, rank, true);
+        return;
+    }
+    push_block(pool, page, rank);
+    SHARED_ADD(&pool->lazy_debt, 1);
+}
+
+// merge every pair of free buddies, ranks are swept bottom up
+static void coalesce(buddy_pool_t *pool) {
+    bool held = solo_enter();
+    __atomic_store_n(&pool->lazy_debt, 0, __ATOMIC_RELAXED);
+    for (uint8_t rank = 1; rank < RANK_NUM(pool); ++rank) {
+        lock_rank(pool, rank);
+        for (int list = 0; list < FREE_LISTS; ++list) {
+            for (list_t *node = pool->bucket[rank][list], *next; node != NULL; node = next) {
+                pfn_t page = ptr_to_page(pool, node);
+                pfn_t buddy = (page >> (rank - 1)) ^ 1;
+                next = node->next;
+                if (!TEST_BIT(pool->free_map, BIT(pool, rank, buddy))) continue;
+                // the buddy leaves this list as well, merged blocks go to higher ranks
+                if (next == page_to_ptr(pool, buddy << (rank - 1))) next = next->next;
+                remove_block(pool, page, rank);
+                merge_block(pool, page, rank, false);
+            }
+        }
+        unlock_rank(pool, rank);
+    }
+    solo_leave(held);
+}
+
+// run a sweep once enough merges are owed, with no rank lock held
+static void lazy_settle(buddy_pool_t *pool) {
+    if (!(FEATURES(pool) & FEAT_LAZY)) return;
+    uint32_t limit = __atomic_load_n(&pool->lazy_limit, __ATOMIC_RELAXED);
+    if (limit != 0 && __atomic_load_n(&pool->lazy_debt, __ATOMIC_RELAXED) >= limit)
+        coalesce(pool);
+}
+
+/*
+ * The rank of the free block to split for a block of `rank` and `type`, with
+ * the list it is in stored into `from`, or 0 if there is none. The lowest
+ * non-empty rank of the type is found in one step, in the zeroed lists first
+ * if `zero` is set and last otherwise; failing that, the largest block of
+ * another type is taken.
+ */
+static uint8_t find_block(buddy_pool_t *pool, uint8_t rank, int type, bool zero, int *from) {
+    int first = zero? MIGRATE_TYPES: 0, second = zero? 0: MIGRATE_TYPES;
+    uint64_t avail = __atomic_load_n(&pool->free_mask[type + first], __ATOMIC_RELAXED) & (~0ull << rank);
+    *from = type + first;
+    if (avail != 0) return __builtin_ctzll(avail);
+    avail = __atomic_load_n(&pool->free_mask[type + second], __ATOMIC_RELAXED) & (~0ull << rank);
+    *from = type + second;
+    if (avail != 0) return __builtin_ctzll(avail);
+    for (int t = 0; t < MIGRATE_TYPES; ++t) {
+        if (t == type) continue;
+        uint64_t preferred = __atomic_load_n(&pool->free_mask[t + first], __ATOMIC_RELAXED);
+        avail = (preferred | __atomic_load_n(&pool->free_mask[t + second], __ATOMIC_RELAXED)) &
+            (~0ull << rank);
+        if (avail == 0) continue;
+        uint8_t big = 63 - __builtin_clzll(avail);
+        *from = t + ((preferred >> big) & 1? first: second);
+        return big;
+    }
+    return 0;
+}
+
+/*
+ * Split a block of rank `big` taken off the free lists down to `rank`, keeping
+ * its first block as used and returning the upper halves to the lower ranks.
+ * Return whether the block was zeroed, as are then the halves and the block
+ * kept, whose zero bit is left set for the caller to cut it further.
+ */
+static bool split_block(buddy_pool_t *pool, pfn_t page, uint8_t big, uint8_t rank) {
+    bool zero = is_zero(pool, page, big);
+    if (big > rank) SHARED_ADD(&pool->splits, big - rank);
+    while (big > rank) {
+        SET_BIT(pool->split_map, BIT(pool, big, page >> (big - 1)));
+        big--;
+        CLEAR_BIT(pool->free_map, BIT(pool, big, page >> (big - 1)));
+        pfn_t half = page + ((pfn_t)1 << (big - 1));
+        set_zero(pool, half, big, zero);
+        lock_rank(pool, big);
+        push_block(pool, half, big);
+        unlock_rank(pool, big);
+    }
+    CLEAR_BIT(pool->split_map, BIT(pool, rank, page >> (rank - 1)));
+    set_zero(pool, page, rank, zero);
+    pool->order[page] = rank;
+    return zero;
+}
+
+/*
+ * Zero whole pages, with streaming stores where there are any so that the
+ * caches are left to those using them.
+ */
+static void clear_pages(void *p, size_t bytes) {
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    for (__m128i *q = p, *end = (__m128i *)((char *)p + bytes); q < end; q += 4) {
+        _mm_stream_si128(q, zero);
+        _mm_stream_si128(q + 1, zero);
+        _mm_stream_si128(q + 2, zero);
+        _mm_stream_si128(q + 3, zero);
+    }
+    // streaming stores are weakly ordered, they must land before the pages are freed
+    _mm_sfence();
+#else
+    memset(p, 0, bytes);
+#endif
+}
+
+/*
+ * Allocate a block of `rank` and `type`, zeroed if `zero` is set: a zeroed
+ * block is taken if there is one, otherwise the block is cleared here, with
+ * plain stores since the caller is about to touch it. A miss waits once for
+ * the block being zeroed if `wait` is set, which the zeroing thread must not.
+ */
+static void *_alloc_pages(buddy_pool_t *pool, uint8_t rank, int type, bool zero, bool wait) {
+    int64_t page;
+    uint8_t split_rank;
+    int from;
+    bool swept = false, waited = false;
+    do {
+        split_rank = find_block(pool, rank, type, zero, &from);
+        if (split_rank == 0) {
+            // the block being zeroed, and what it was cut from, is given back shortly
+            uint32_t zeroing = __atomic_load_n(&pool->zeroing, __ATOMIC_ACQUIRE);
+            if (wait && !waited && (zeroing & 1)) {
+                pthread_mutex_lock(&pool->zero_lock);
+                while (__atomic_load_n(&pool->zeroing, __ATOMIC_ACQUIRE) == zeroing)
+                    pthread_cond_wait(&pool->zero_cond, &pool->zero_lock);
+                pthread_mutex_unlock(&pool->zero_lock);
+                waited = true;
+                page = -1;
+                continue;
+            }
+            // deferred merges may yet make up a large enough block
+            if (swept || __atomic_load_n(&pool->lazy_debt, __ATOMIC_RELAXED) == 0)
+                return (void*)-ENOSPC;
+            coalesce(pool);
+            swept = true;
+            page = -1;
+            continue;
+        }
+        // another thread may have emptied the list since the mask was read
+        page = pop_block(pool, split_rank, from);
+    } while (page < 0);
+    if (from % MIGRATE_TYPES != type) __atomic_add_fetch(&pool->steals, 1, __ATOMIC_RELAXED);
+    // before the halves are pushed, so that those in claimed pageblocks follow
+    claim_pageblocks(pool, page, page + ((pfn_t)1 << (rank - 1)), split_rank, type);
+    bool zeroed = split_block(pool, page, split_rank, rank);
+    account(pool, -((int64_t)1 << (rank - 1)));
+    void *ret = page_to_ptr(pool, page);
+    if (zero && zeroed) {
+        // all but the links it was listed with
+        memset(ret, 0, sizeof(list_t));
+    } else if (zero) {
+        memset(ret, 0, (size_t)PAGE_SIZE << (rank - 1));
+        __atomic_add_fetch(&pool->zero_fills, 1ull << (rank - 1), __ATOMIC_RELAXED);
+    }
     return ret;
 }
 
-#define ROOT 0
-#define PARENT(node) ((node - 1) / 2)
-#define CHILD(node, sel) ((node) * 2 + (sel) + 1)
-#define BUDDY(node) ((((node) - 1) ^ 1) + 1)
+// the rank of the largest block headed by `page` that ends at or before `end`
+static uint8_t max_rank(buddy_pool_t *pool, pfn_t page, pfn_t end) {
+    uint8_t rank = _log2(end - page) + 1;
+    if (page != 0 && __builtin_ctzll(page) + 1 < rank) rank = __builtin_ctzll(page) + 1;
+    uint8_t top = RANK_NUM(pool);
+    return rank < top? rank: top;
+}
 
-static uint32_t block_to_page(uint32_t block, uint8_t rank) {
-    return (block - (1 << (rank_num - rank)) + 1) << (rank - 1);
+/*
+ * Push the free pages [page, last) of a block being cut as maximal aligned
+ * blocks, zeroed if the block was, return how many there were.
+ */
+static uint64_t free_tail(buddy_pool_t *pool, pfn_t page, pfn_t last, bool zero) {
+    uint64_t blocks = 0;
+    for (; page < last; ++blocks) {
+        uint8_t rank = max_rank(pool, page, last);
+        set_zero(pool, page, rank, zero);
+        lock_rank(pool, rank);
+        push_block(pool, page, rank);
+        unlock_rank(pool, rank);
+        page += (pfn_t)1 << (rank - 1);
+    }
+    return blocks;
 }
 
-static void* block_to_ptr(uint32_t block, uint8_t rank) {
-    return base_ptr + block_to_page(block, rank) * PAGE_SIZE;
+// count the splits of a block cut into `blocks` blocks, one fewer than them
+static void count_splits(buddy_pool_t *pool, uint64_t blocks) {
+    if (blocks > 1) SHARED_ADD(&pool->splits, blocks - 1);
 }
 
-static bool is_valid_ptr(void *ptr) {
-    if (ptr < base_ptr) return false;
-    if ((ptr - base_ptr) % PAGE_SIZE != 0) return false;
-    return (ptr - base_ptr) / PAGE_SIZE <= page_num;
+/*
+ * Cut the first `pieces` blocks of `rank` out of a block of rank `big` taken off
+ * the free lists, store them into `out`, and free the rest of the block as its
+ * maximal aligned blocks, none of which are buddies of each other.
+ */
+static int carve(buddy_pool_t *pool, pfn_t page, uint8_t big, uint8_t rank,
+                 uint32_t pieces, void **out) {
+    pfn_t size = (pfn_t)1 << (rank - 1);
+    pfn_t end = page + pieces * size, last = page + ((pfn_t)1 << (big - 1));
+    bool zero = is_zero(pool, page, big);
+    for (uint8_t r = rank + 1; r <= big; ++r) {
+        for (pfn_t i = page >> (r - 1); i <= (end - 1) >> (r - 1); ++i) {
+            SET_BIT(pool->split_map, BIT(pool, r, i));
+            CLEAR_BIT(pool->free_map, BIT(pool, r, i));
+        }
+    }
+    for (uint32_t i = 0; i < pieces; ++i) {
+        uint64_t bit = BIT(pool, rank, (page >> (rank - 1)) + i);
+        CLEAR_BIT(pool->split_map, bit);
+        CLEAR_BIT(pool->free_map, bit);
+        pool->order[page + i * size] = rank;
+        out[i] = page_to_ptr(pool, page + i * size);
+    }
+    count_splits(pool, pieces + free_tail(pool, end, last, zero));
+    return pieces;
 }
 
-static uint32_t ptr_to_page(void *ptr) {
-    return (uint32_t)(ptr - base_ptr) / PAGE_SIZE;
+/*
+ * Keep the pages [page, end) of a block of rank `big` taken off the free lists
+ * as used blocks of maximal rank and free the rest of the block, so that a run
+ * of any length is served with less than one page of each rank left over.
+ */
+static void trim_block(buddy_pool_t *pool, pfn_t page, uint8_t big, pfn_t end) {
+    pfn_t last = page + ((pfn_t)1 << (big - 1));
+    bool zero = is_zero(pool, page, big);
+    uint64_t kept = 0;
+    for (pfn_t head = page; head < end; ++kept) {
+        uint8_t rank = max_rank(pool, head, end);
+        for (uint8_t r = rank + 1; r <= big; ++r) {
+            uint64_t bit = BIT(pool, r, head >> (r - 1));
+            SET_BIT(pool->split_map, bit);
+            CLEAR_BIT(pool->free_map, bit);
+        }
+        uint64_t bit = BIT(pool, rank, head >> (rank - 1));
+        CLEAR_BIT(pool->split_map, bit);
+        CLEAR_BIT(pool->free_map, bit);
+        pool->order[head] = rank;
+        head += (pfn_t)1 << (rank - 1);
+    }
+    count_splits(pool, kept + free_tail(pool, end, last, zero));
+    account(pool, last - end);
 }
 
-int init_page(void *p, int pgcount) {
-    base_ptr = p;
-    rank_num = _log2(pgcount) + 1;
+// allocate up to `n` blocks of `rank` and `type` into `out`, return how many were
+static int _alloc_bulk(buddy_pool_t *pool, uint8_t rank, int type, int n, void **out) {
+    int got = 0;
+    // free blocks of the very rank first, under a single lock, zeroed ones last
+    lock_rank(pool, rank);
+    for (int list = type; list < FREE_LISTS; list += MIGRATE_TYPES) {
+        while (got < n && pool->bucket[rank][list] != NULL) {
+            pfn_t page = first_block(pool, rank, list);
+            remove_block(pool, page, rank);
+            pool->order[page] = rank;
+            out[got++] = page_to_ptr(pool, page);
+        }
+    }
+    unlock_rank(pool, rank);
+    account(pool, -((int64_t)got << (rank - 1)));
+
+    // then larger blocks, each split only once into as many blocks as needed
+    bool swept = false;
+    while (got < n) {
+        int from;
+        uint8_t big = find_block(pool, rank, type, false, &from);
+        if (big == 0) {
+            if (swept || __atomic_load_n(&pool->lazy_debt, __ATOMIC_RELAXED) == 0) break;
+            coalesce(pool);
+            swept = true;
+            got += _alloc_bulk(pool, rank, type, n - got, out + got);
+            break;
+        }
+        int64_t page = pop_block(pool, big, from);
+        if (page < 0) continue;
+        if (from % MIGRATE_TYPES != type) __atomic_add_fetch(&pool->steals, 1, __ATOMIC_RELAXED);
+        pfn_t pieces = (pfn_t)1 << (big - rank);
+        if (pieces > (pfn_t)(n - got)) pieces = n - got;
+        claim_pageblocks(pool, page, page + pieces * ((pfn_t)1 << (rank - 1)), big, type);
+        got += carve(pool, page, big, rank, pieces, out + got);
+        account(pool, -(int64_t)(pieces << (rank - 1)));
+    }
+    return got;
+}
+
+// free the used pages [page, end) as maximal aligned blocks, merging each
+static void free_range(buddy_pool_t *pool, pfn_t page, pfn_t end) {
+    while (page < end) {
+        uint8_t rank = max_rank(pool, page, end);
+        lock_rank(pool, rank);
+        free_block(pool, page, rank, false);
+        unlock_rank(pool, rank);
+        page += (pfn_t)1 << (rank - 1);
+    }
+}
+
+/*
+ * Compaction. To make up a free block of rank R, the aligned window of rank R
+ * holding the fewest used pages is picked among those whose used blocks may
+ * all be moved, and each of them is moved by the caller's callback into a free
+ * block outside the window. Freeing the old blocks then merges the window.
+ * A block may be moved if it is not held by a per-thread cache and, with
+ * grouping, lies in a movable pageblock; the callback may still refuse.
+ */
+typedef struct used_t used_t;
+
+struct used_t {
+    pfn_t page;
+    uint8_t rank;
+};
+
+/*
+ * The pages of the used blocks in [page, end), or -1 if one of them cannot be
+ * moved. Unless `used` is NULL the blocks are stored into it, followed by one
+ * of rank 0, or -1 is returned if more than `cap` would be.
+ */
+static int64_t window_used(buddy_pool_t *pool, pfn_t page, pfn_t end, used_t *used,
+                           int64_t cap) {
+    int64_t pages = 0, n = 0;
+    while (page < end) {
+        uint8_t o = pool->order[page], rank = ORDER_RANK(o);
+        if ((o & ORDER_CACHED) || !is_block(pool, page, rank)) return -1;
+        pfn_t size = (pfn_t)1 << (rank - 1);
+        if (page + size > end) return -1;
+        if (!TEST_BIT(pool->free_map, BIT(pool, rank, page >> (rank - 1)))) {
+            if (pool->pb_rank != 0 && block_type(pool, page) != PAGE_MOVABLE) return -1;
+            if (used != NULL && n == cap) return -1;
+            if (used != NULL) used[n++] = (used_t) {page, rank};
+            pages += size;
+        }
+        page += size;
+    }
+    if (used != NULL) used[n].rank = 0;
+    return pages;
+}
+
+// take a free block of `rank` lying outside [start, end) for a moved block, or return -1
+static int64_t take_outside(buddy_pool_t *pool, uint8_t rank, pfn_t start, pfn_t end) {
+    int type = pool->pb_rank != 0? PAGE_MOVABLE: 0;
+    for (uint8_t big = rank; big <= RANK_NUM(pool); ++big) {
+        pfn_t size = (pfn_t)1 << (big - 1);
+        lock_rank(pool, big);
+        for (int list = type; list < FREE_LISTS; list += MIGRATE_TYPES) {
+            for (list_t *node = pool->bucket[big][list]; node != NULL; node = node->next) {
+                pfn_t page = ptr_to_page(pool, node);
+                if (page < end && page + size > start) continue;
+                remove_block(pool, page, big);
+                unlock_rank(pool, big);
+                split_block(pool, page, big, rank);
+                account(pool, -((int64_t)1 << (rank - 1)));
+                return page;
+            }
+        }
+        unlock_rank(pool, big);
+    }
+    return -1;
+}
+
+/*
+ * A window of `rank` to clear, with the pages to move out of it stored into
+ * `pages`, or -1 if none can be cleared. Windows are looked at from where the
+ * last compaction left off, and the first one needing at most half of it moved
+ * is taken, otherwise the one needing the fewest.
+ */
+static int64_t pick_window(buddy_pool_t *pool, uint8_t rank, int64_t *pages) {
+    pfn_t size = (pfn_t)1 << (rank - 1);
+    int64_t best = -1, best_used = 0;
+    uint64_t free_pages = 0;
+    for (uint8_t r = 1; r <= RANK_NUM(pool); ++r)
+        free_pages += __atomic_load_n(&pool->count[r], __ATOMIC_RELAXED) << (r - 1);
+    // the free pages outside a window must hold its used ones
+    pfn_t windows = pool->page_num >> (rank - 1);
+    if (free_pages < size || windows == 0) return -1;
+    pfn_t first = (pool->compact_next >> (rank - 1)) % windows;
+    for (pfn_t i = 0; i < windows; ++i) {
+        pfn_t page = ((first + i) % windows) << (rank - 1);
+        int64_t used = window_used(pool, page, page + size, NULL, 0);
+        if (used < 0 || (best >= 0 && used >= best_used)) continue;
+        best = page;
+        best_used = used;
+        if (used <= (int64_t)(size / 2)) break;
+    }
+    if (best >= 0) pool->compact_next = best + size;
+    *pages = best_used;
+    return best;
+}
+
+// whether a free block of `rank` or above is listed
+static bool has_free(buddy_pool_t *pool, uint8_t rank) {
+    for (int list = 0; list < FREE_LISTS; ++list)
+        if (__atomic_load_n(&pool->free_mask[list], __ATOMIC_RELAXED) >> rank != 0) return true;
+    return false;
+}
+
+/*
+ * Make up a free block of `rank`, return how many blocks were moved, or -ENOSPC
+ * if there is still none. Unless `wait` is set, give up at once if another
+ * compaction is under way, which may be the one calling back into the pool.
+ */
+static int compact(buddy_pool_t *pool, uint8_t rank, bool wait) {
+    int moved = 0;
+    bool held = solo_enter();
+    if (!wait && pthread_mutex_trylock(&pool->compact_lock) != 0) {
+        solo_leave(held);
+        return -ENOSPC;
+    }
+    if (wait) pthread_mutex_lock(&pool->compact_lock);
+    if (__atomic_load_n(&pool->lazy_debt, __ATOMIC_RELAXED) != 0) coalesce(pool);
+    if (has_free(pool, rank)) {
+        pthread_mutex_unlock(&pool->compact_lock);
+        solo_leave(held);
+        return 0;
+    }
+    int64_t pages;
+    int64_t start = pick_window(pool, rank, &pages);
+    pfn_t end = start + ((pfn_t)1 << (rank - 1));
+    // no more used blocks than used pages, unless some were allocated since
+    used_t *used = start < 0? NULL: malloc((pages + 1) * sizeof(used_t));
+    if (used != NULL && window_used(pool, start, end, used, pages) < 0) used[0].rank = 0;
+    for (int64_t i = 0; used != NULL && used[i].rank != 0; ++i) {
+        pfn_t page = used[i].page;
+        uint8_t r = used[i].rank;
+        // the block may have been freed since the window was scanned
+        if (!is_used(pool, page, r)) break;
+        int64_t to = take_outside(pool, r, start, end);
+        if (to < 0) break;
+        if (pool->migrate(page_to_ptr(pool, page), page_to_ptr(pool, to), r,
+                          pool->migrate_arg) != OK) {
+            lock_rank(pool, r);
+            free_block(pool, to, r, false);
+            unlock_rank(pool, r);
+            break;
+        }
+        lock_rank(pool, r);
+        free_block(pool, page, r, false);
+        unlock_rank(pool, r);
+        moved++;
+    }
+    free(used);
+    __atomic_add_fetch(&pool->migrations, moved, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&pool->lazy_debt, __ATOMIC_RELAXED) != 0) coalesce(pool);
+    pthread_mutex_unlock(&pool->compact_lock);
+    solo_leave(held);
+    return has_free(pool, rank)? moved: -ENOSPC;
+}
+
+// push the linked pages from `first` to `last`, `n` of them, onto the lock-free stack
+static void lf_push(buddy_pool_t *pool, pfn_t first, pfn_t last, uint32_t n) {
+    uint64_t *link = page_to_ptr(pool, last);
+    uint64_t head = __atomic_load_n(&pool->lf_head, __ATOMIC_RELAXED), top;
+    do {
+        __atomic_store_n(link, head & LF_PFN_MASK, __ATOMIC_RELAXED);
+        top = ((head & ~LF_PFN_MASK) + LF_TAG) | (first + 1);
+    } while (!__atomic_compare_exchange_n(&pool->lf_head, &head, top, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&pool->lf_count, n, __ATOMIC_RELAXED);
+}
+
+// pop a page off the lock-free stack, or return -1 if it is empty
+static int64_t lf_pop(buddy_pool_t *pool) {
+    uint64_t head = __atomic_load_n(&pool->lf_head, __ATOMIC_ACQUIRE), top;
+    do {
+        if ((head & LF_PFN_MASK) == 0) return -1;
+        uint64_t *link = page_to_ptr(pool, (head & LF_PFN_MASK) - 1);
+        top = ((head & ~LF_PFN_MASK) + LF_TAG) | __atomic_load_n(link, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&pool->lf_head, &head, top, true,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    __atomic_sub_fetch(&pool->lf_count, 1, __ATOMIC_RELAXED);
+    return (head & LF_PFN_MASK) - 1;
+}
+
+// give stacked pages back to the buddy until at most `target` remain
+static void lf_drain(buddy_pool_t *pool, uint32_t target) {
+    int64_t page;
+    bool held = solo_enter();
+    lock_rank(pool, 1);
+    while (__atomic_load_n(&pool->lf_count, __ATOMIC_RELAXED) > target &&
+           (page = lf_pop(pool)) >= 0) {
+        if (pool->order[page] == (1 | ORDER_CACHED)) free_block(pool, page, 1, false);
+    }
+    unlock_rank(pool, 1);
+    solo_leave(held);
+}
+
+// stack a page freed by its user, draining the stack if it grows too large
+static void lf_free(buddy_pool_t *pool, pfn_t page) {
+    pool->order[page] = 1 | ORDER_CACHED;
+    lf_push(pool, page, page, 1);
+    uint32_t high = __atomic_load_n(&pool->lf_high, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&pool->lf_count, __ATOMIC_RELAXED) > high) {
+        lf_drain(pool, high - pool->lf_batch);
+        lazy_settle(pool);
+    }
+}
+
+/*
+ * Refill the lock-free stack with a batch of pages from the buddy, return one
+ * more taken for the caller, or -1 if there is none.
+ */
+static int64_t lf_refill(buddy_pool_t *pool) {
+    void *pages[64];
+    int want = pool->lf_batch < 64? pool->lf_batch: 64;
+    bool held = solo_enter();
+    int got = _alloc_bulk(pool, 1, PAGE_UNMOVABLE, want, pages);
+    solo_leave(held);
+    if (got == 0) return -1;
+    pfn_t first = ptr_to_page(pool, pages[0]), prev = first;
+    for (int i = 1; i < got; ++i) {
+        pfn_t page = ptr_to_page(pool, pages[i]);
+        pool->order[page] = 1 | ORDER_CACHED;
+        if (i > 1) *(uint64_t *)pages[i - 1] = page + 1;
+        prev = page;
+    }
+    if (got > 1) lf_push(pool, ptr_to_page(pool, pages[1]), prev, got - 1);
+    return first;
+}
+
+static void *lf_alloc(buddy_pool_t *pool) {
+    int64_t page = lf_pop(pool);
+    if (page < 0) page = lf_refill(pool);
+    if (page < 0) return (void*)-ENOSPC;
+    pool->order[page] = 1;
+    return page_to_ptr(pool, page);
+}
+
+// give cached pages back until at most `target` remain, to the lock-free stack first
+static void pcp_shrink(pcp_t *pc, uint32_t target) {
+    buddy_pool_t *pool = pc->pool;
+    uint32_t high = __atomic_load_n(&pool->lf_high, __ATOMIC_RELAXED);
+    while (pc->count > target && __atomic_load_n(&pool->lf_count, __ATOMIC_RELAXED) < high) {
+        list_t *node = pc->list;
+        pc->list = node->next;
+        pc->count--;
+        lf_push(pool, ptr_to_page(pool, node), ptr_to_page(pool, node), 1);
+    }
+    if (pc->count <= target) return;
+    bool held = solo_enter();
+    lock_rank(pool, 1);
+    while (pc->count > target) {
+        list_t *node = pc->list;
+        pfn_t page = ptr_to_page(pool, node);
+        pc->list = node->next;
+        pc->count--;
+        if (pool->order[page] == (1 | ORDER_CACHED)) free_block(pool, page, 1, false);
+    }
+    unlock_rank(pool, 1);
+    solo_leave(held);
+}
+
+static void pcp_cache(pcp_t *pc, list_t *node) {
+    pc->pool->order[ptr_to_page(pc->pool, node)] = 1 | ORDER_CACHED;
+    node->next = pc->list;
+    pc->list = node;
+    pc->count++;
+}
+
+static void pcp_refill(pcp_t *pc) {
+    void *pages[64];
+    buddy_pool_t *pool = pc->pool;
+    int64_t page;
+    while (pc->count < pool->pcp_batch && (page = lf_pop(pool)) >= 0)
+        pcp_cache(pc, page_to_ptr(pool, page));
+    if (pc->count >= pool->pcp_batch) return;
+    bool held = solo_enter();
+    while (pc->count < pool->pcp_batch) {
+        int want = pool->pcp_batch - pc->count;
+        int got = _alloc_bulk(pool, 1, PAGE_UNMOVABLE, want < 64? want: 64, pages);
+        for (int i = 0; i < got; ++i) pcp_cache(pc, pages[i]);
+        if (got == 0) break;
+    }
+    solo_leave(held);
+}
+
+// drain the cache of an exiting thread and forget it
+static void pcp_destroy(void *arg) {
+    pcp_t *pc = arg;
+    buddy_pool_t *pool = pc->pool;
+    pcp_shrink(pc, 0);
+    pthread_mutex_lock(&pool->pcp_lock);
+    if (pc->prev != NULL) pc->prev->next = pc->next;
+    else pool->pcp_list = pc->next;
+    if (pc->next != NULL) pc->next->prev = pc->prev;
+    pthread_mutex_unlock(&pool->pcp_lock);
+    free(pc);
+}
+
+// the calling thread's cache of `pool`, or NULL if it cannot be set up
+static pcp_t *this_pcp(buddy_pool_t *pool) {
+    pcp_t *pc = pthread_getspecific(pool->pcp_key);
+    if (pc != NULL) return pc;
+    pc = malloc(sizeof(pcp_t));
+    if (pc == NULL) return NULL;
+    *pc = (pcp_t) {NULL, 0, pool, NULL, NULL};
+    pthread_mutex_lock(&pool->pcp_lock);
+    pc->next = pool->pcp_list;
+    if (pc->next != NULL) pc->next->prev = pc;
+    pool->pcp_list = pc;
+    pthread_mutex_unlock(&pool->pcp_lock);
+    pthread_setspecific(pool->pcp_key, pc);
+    return pc;
+}
+
+static void *pcp_alloc(buddy_pool_t *pool) {
+    pcp_t *pc = this_pcp(pool);
+    if (pc == NULL) return _alloc_pages(pool, 1, PAGE_UNMOVABLE, false, true);
+    if (pc->count == 0) pcp_refill(pc);
+    if (pc->count == 0) return (void*)-ENOSPC;
+    list_t *node = pc->list;
+    pc->list = node->next;
+    pc->count--;
+    pool->order[ptr_to_page(pool, node)] = 1;
+    return node;
+}
+
+/*
+ * Blocks that straddle the end of the region are marked split and used, and the
+ * blocks wholly past its end next to them used, so that blocks in the tail never
+ * merge beyond the region while the existence rule still holds for them.
+ */
+static void seal_tail(buddy_pool_t *pool) {
+    for (uint8_t rank = 1; rank <= pool->rank_num; ++rank) {
+        pfn_t index = pool->page_num >> (rank - 1);
+        if (index << (rank - 1) != pool->page_num)
+            SET_BIT(pool->split_map, BIT(pool, rank, index));
+        CLEAR_BIT(pool->free_map, BIT(pool, rank, index));
+        CLEAR_BIT(pool->free_map, BIT(pool, rank, index | 1));
+    }
+}
+
+// make the pageblocks of a span of `page_num` pages movable, from pageblock `first` on
+static int pb_setup(buddy_pool_t *pool, pfn_t page_num, uint8_t pb_rank, pfn_t first) {
+    pfn_t blocks = (page_num >> (pb_rank - 1)) + 1;
+    if (pool->pb_cap < blocks) {
+        uint8_t *pb_type = realloc(pool->pb_type, blocks);
+        if (pb_type == NULL) return -ENOMEM;
+        pool->pb_type = pb_type;
+        pool->pb_cap = blocks;
+    }
+    for (pfn_t i = first; i < blocks; ++i) pool->pb_type[i] = PAGE_MOVABLE;
+    return OK;
+}
+
+/*
+ * Lay out the summaries of ranks 1 to `rank_num` and clear them, and clear the
+ * free bits of the ranks in `ranks` so that they can be trusted from now on.
+ */
+static int sum_setup(buddy_pool_t *pool, uint32_t rank_num, uint64_t ranks) {
+    size_t total = 0;
+    for (uint8_t rank = 1; rank <= rank_num; ++rank) {
+        uint64_t words = (pool->map_off[rank + 1] - pool->map_off[rank]) >> 6;
+        int l = 0;
+        do {
+            words = (words + 63) >> 6;
+            pool->sum_off[rank][++l] = total;
+            total += words;
+        } while (words > 1);
+        pool->sum_levels[rank] = l;
+    }
+    if (pool->sum_cap < total) {
+        uint64_t *sum_map = realloc(pool->sum_map, total * sizeof(uint64_t));
+        if (sum_map == NULL) return -ENOMEM;
+        pool->sum_map = sum_map;
+        pool->sum_cap = total;
+    }
+    for (size_t i = 0; i < total; ++i) pool->sum_map[i] = 0;
+    for (uint8_t rank = 1; rank <= rank_num; ++rank) {
+        if (((ranks >> rank) & 1) == 0) continue;
+        for (uint64_t w = pool->map_off[rank] >> 6; w < pool->map_off[rank + 1] >> 6; ++w)
+            __atomic_store_n(&pool->free_map[w], 0, __ATOMIC_RELAXED);
+    }
+    return OK;
+}
+
+/*
+ * Lay out the bitmaps of a span of `span` pages into `map_off` and return how
+ * many ranks it has. Each rank's bitmap starts at a word boundary, so ranks
+ * never share a word, and has a spare bit for the buddy of a block straddling
+ * the end of the span.
+ */
+static uint32_t layout(uint64_t *map_off, pfn_t span) {
+    uint32_t ranks = _log2(span) + 1;
+    map_off[1] = 0;
+    for (uint32_t i = 1; i <= ranks; ++i) {
+        pfn_t blocks = (span >> (i - 1)) + 2;
+        map_off[i + 1] = (map_off[i] + blocks + 63) & ~(uint64_t)63;
+    }
+    return ranks;
+}
+
+// take the locks of ranks 1 to `ranks`, in increasing order
+static void lock_ranks(buddy_pool_t *pool, uint32_t ranks) {
+    for (uint8_t rank = 1; rank <= ranks; ++rank)
+        lock_rank(pool, rank);
+}
+
+static void unlock_ranks(buddy_pool_t *pool, uint32_t ranks) {
+    for (uint8_t rank = ranks; rank >= 1; --rank)
+        unlock_rank(pool, rank);
+}
+
+// set the free bits and summaries of the address-ordered ranks back from the lists
+static void addr_relist(buddy_pool_t *pool) {
+    for (uint8_t rank = 1; rank <= pool->rank_num; ++rank) {
+        if (!ADDR_ORDERED(pool, rank)) continue;
+        for (int list = 0; list < FREE_LISTS; ++list) {
+            for (list_t *node = pool->bucket[rank][list]; node != NULL; node = node->next) {
+                pfn_t index = ptr_to_page(pool, node) >> (rank - 1);
+                SET_BIT(pool->free_map, BIT(pool, rank, index));
+                sum_set(pool, rank, index);
+            }
+        }
+    }
+}
+
+/*
+ * Lay the metadata out anew for a span of `span` pages, keeping all it says
+ * of the pages it covers so far; the bits and order bytes of the new pages
+ * start out clear.
+ * Not thread-safe, the buffers move.
+ */
+static int meta_grow(buddy_pool_t *pool, pfn_t span) {
+    uint64_t map_off[MAX_RANK_NUM + 2];
+    uint32_t ranks = layout(map_off, span);
+    size_t words = map_off[ranks + 1] / 64;
+    uint64_t *split_map = calloc(words, sizeof(uint64_t));
+    uint64_t *free_map = calloc(words, sizeof(uint64_t));
+    uint64_t *zero_map = calloc(words, sizeof(uint64_t));
+    uint8_t *order = calloc(span, 1);
+    if (split_map == NULL || free_map == NULL || zero_map == NULL || order == NULL ||
+        (pool->pb_rank != 0 && pb_setup(pool, span, pool->pb_rank,
+                                        (pool->meta_cap >> (pool->pb_rank - 1)) + 1) != OK)) {
+        free(split_map);
+        free(free_map);
+        free(zero_map);
+        free(order);
+        return -ENOMEM;
+    }
+    if (pool->meta_cap != 0) memcpy(order, pool->order, pool->meta_cap);
+    free(pool->order);
+    pool->order = order;
+    for (uint8_t rank = 1; rank <= pool->meta_ranks; ++rank) {
+        size_t from = pool->map_off[rank] / 64, to = map_off[rank] / 64;
+        size_t n = (pool->map_off[rank + 1] - pool->map_off[rank]) / 8;
+        memcpy(split_map + to, pool->split_map + from, n);
+        memcpy(free_map + to, pool->free_map + from, n);
+        memcpy(zero_map + to, pool->zero_map + from, n);
+    }
+    free(pool->split_map);
+    free(pool->free_map);
+    free(pool->zero_map);
+    pool->split_map = split_map;
+    pool->free_map = free_map;
+    pool->zero_map = zero_map;
+    memcpy(pool->map_off, map_off, sizeof(map_off));
+    pool->meta_cap = span;
+    pool->meta_ranks = ranks;
+    if (pool->addr_mask == 0) return OK;
+    // the summaries follow the bitmaps, failing that blocks are handed out LIFO
+    if (sum_setup(pool, ranks, pool->addr_mask) != OK) {
+        pool->addr_mask = 0;
+        return -ENOMEM;
+    }
+    addr_relist(pool);
+    return OK;
+}
+
+static int pool_init(buddy_pool_t *pool, void *p, long pgcount) {
+    if (p == NULL || pgcount < 1) return -EINVAL;
+    uint32_t rank_num = _log2(pgcount) + 1;
+    if (rank_num > MAX_RANK_NUM) return -EINVAL;
+    pfn_t page_num = pgcount;
+
+    // a span laid out for earlier is kept, regions may be added within it
+    pfn_t span = pool->meta_cap > page_num? pool->meta_cap: page_num;
+    uint32_t ranks = layout(pool->map_off, span);
+    if (pool->meta_cap < span) {
+        // bits are stale until written, so the bitmaps are never cleared
+        size_t words = pool->map_off[ranks + 1] / 64;
+        uint64_t *split_map = realloc(pool->split_map, words * sizeof(uint64_t));
+        if (split_map != NULL) pool->split_map = split_map;
+        uint64_t *free_map = realloc(pool->free_map, words * sizeof(uint64_t));
+        if (free_map != NULL) pool->free_map = free_map;
+        uint64_t *zero_map = realloc(pool->zero_map, words * sizeof(uint64_t));
+        if (zero_map != NULL) pool->zero_map = zero_map;
+        // order bytes are trusted, they start out clear
+        uint8_t *order = calloc(span, 1);
+        if (order != NULL) {
+            free(pool->order);
+            pool->order = order;
+        }
+        if (split_map == NULL || free_map == NULL || zero_map == NULL || order == NULL) {
+            pool->meta_cap = pool->meta_ranks = 0;
+            return -ENOMEM;
+        }
+        pool->meta_cap = span;
+    } else {
+        // those of the pages of a previous region
+        memset(pool->order, 0, pool->page_num);
+    }
+    pool->meta_ranks = ranks;
+    if (pool->addr_mask != 0 && sum_setup(pool, ranks, pool->addr_mask) != OK)
+        return -ENOMEM;
+    if (pool->pb_rank != 0 && pb_setup(pool, span, pool->pb_rank, 0) != OK)
+        return -ENOMEM;
+
+    // caches of a previous region hold pages that no longer exist
+    pthread_mutex_lock(&pool->pcp_lock);
+    for (pcp_t *pc = pool->pcp_list; pc != NULL; pc = pc->next) {
+        pc->list = NULL;
+        pc->count = 0;
+    }
+    pthread_mutex_unlock(&pool->pcp_lock);
+    pool->lf_head = 0;
+    pool->lf_count = 0;
+
+    pool->base_ptr = p;
+    pool->rank_num = rank_num;
+    pool->page_num = page_num;
+    pool->region[0] = (region_t) {0, page_num};
+    pool->region_num = 1;
+    pool->present = page_num;
+    if (pool->zero_track) memset(pool->zero_map, 0, pool->map_off[ranks + 1] / 8);
 // printf("[dbg] rank number %d, page_num %d\n", rank_num, page_num);
-    for (int i = 1; i <= rank_num; ++i) bucket[i] = NULL;
-    for (int i = 1; i <= rank_num; ++i) count[i] = 0;
-    for (int i = 0; i < pgcount; ++i) meta[i] = LIST_INITIALIZER;
-    meta[0].status = UNUSED;
-    meta[0].rank = rank_num;
-    meta[0].index = ROOT;
-    list_push(bucket[rank_num], &meta[0]);
-    count[rank_num]++;
+    // ranks above rank_num may be reached once regions are added
+    for (uint32_t i = 1; i <= MAX_RANK_NUM; ++i) {
+        for (int list = 0; list < FREE_LISTS; ++list) pool->bucket[i][list] = NULL;
+        pool->count[i] = pool->zero_count[i] = 0;
+    }
+    for (int list = 0; list < FREE_LISTS; ++list) pool->free_mask[list] = 0;
+    pool->lazy_debt = 0;
+    pool->free_pages = page_num;
+    pool->splits = pool->merges = pool->steals = pool->migrations = 0;
+    pool->reclaims = pool->reclaimed = 0;
+    pool->prezeroed = pool->zero_fills = 0;
+    pool->compact_next = 0;
+    for (uint32_t i = 1; i <= MAX_RANK_NUM; ++i) pool->alloc_fails[i] = 0;
+    // seed the region with its maximal aligned blocks, largest first
+    for (pfn_t page = 0; page < page_num; ) {
+        uint8_t rank = max_rank(pool, page, page_num);
+        push_block(pool, page, rank);
+        page += (pfn_t)1 << (rank - 1);
+    }
+    seal_tail(pool);
     return OK;
 }
 
-void *alloc_pages(int rank) {
-    if (rank < 1 || rank > rank_num) return (void*)-EINVAL;
-    
-    uint8_t unused_rank = rank;
-    while(unused_rank <= rank_num) {
-        if (bucket[unused_rank] != NULL) break;
-        unused_rank++;
-    }
-    if (unused_rank > rank_num) return (void*)-ENOSPC;
-    
-    uint8_t split_rank = unused_rank;
-    while(split_rank > rank) {
-        list_t *block = bucket[split_rank];
-        list_pop(bucket[split_rank]);
-        block->status = UNDEF;
-        count[split_rank]--;
-        
-        split_rank--;
-        uint32_t rchild = CHILD(block->index, 1);
-        uint32_t lchild = CHILD(block->index, 0);
-        list_t *rmeta = &meta[block_to_page(rchild, split_rank)];
-        list_t *lmeta = &meta[block_to_page(lchild, split_rank)];
-        
-        *rmeta = (list_t) {UNUSED, split_rank, rchild, NULL, NULL};
-        *lmeta = (list_t) {UNUSED, split_rank, lchild, NULL, NULL};
-        list_push(bucket[split_rank], rmeta); 
-        list_push(bucket[split_rank], lmeta); 
-        count[split_rank] += 2;
-    }
-
-    list_t *block = bucket[rank];
-    list_pop(bucket[rank]);
-    block->status = USED;
-    count[rank]--;
-
-    return block_to_ptr(block->index, rank);
+static int pool_setup(buddy_pool_t *pool) {
+    for (uint32_t i = 0; i <= MAX_RANK_NUM; ++i)
+        pthread_mutex_init(&pool->rank_lock[i], NULL);
+    pthread_mutex_init(&pool->pcp_lock, NULL);
+    pthread_mutex_init(&pool->compact_lock, NULL);
+    pthread_mutex_init(&pool->region_lock, NULL);
+    pthread_mutex_init(&pool->wmark_lock, NULL);
+    pthread_cond_init(&pool->wmark_cond, NULL);
+    pthread_mutex_init(&pool->zero_lock, NULL);
+    pthread_cond_init(&pool->zero_cond, NULL);
+    return pthread_key_create(&pool->pcp_key, pcp_destroy) == 0? OK: -ENOMEM;
 }
 
-int return_pages(void *p) {
-    list_t *node, *buddy;
-// printf("[dbg] offset 0x%x, validity %d\n", p - base_ptr, is_valid_ptr(p));
-    if (!is_valid_ptr(p)) return -EINVAL;
-    node = &meta[ptr_to_page(p)];
-// printf("[dbg] page %d, status %d\n", ptr_to_page(p), meta->status);
-    if (node->status != USED) return -EINVAL;
-    
-    uint8_t rank = node->rank;
-    uint32_t index = node->index;
-// printf("[dbg] page %d, rank %d\n", ptr_to_page(p), rank);
-// printf("[dbg] page %d, index %d\n", ptr_to_page(p), index);
-    while (rank < rank_num) {
-        node = &meta[block_to_page(index, rank)];
-        buddy = &meta[block_to_page(BUDDY(index), rank)];
-// printf("[dbg] node_page %d, buddy_page %d\n", 
-    // block_to_page(index, rank), block_to_page(BUDDY(index), rank));
-        
-        if (buddy->rank != rank || buddy->status != UNUSED) break;
-        node->status = buddy->status = UNDEF;
-        list_remove(bucket[rank], buddy);
-        count[rank]--;
+buddy_pool_t *buddy_pool_create(void *p, long pgcount) {
+    buddy_pool_t *pool = calloc(1, sizeof(buddy_pool_t));
+    if (pool == NULL) return ERR_PTR(-ENOMEM);
+    int ret = pool_setup(pool);
+    if (ret == OK) ret = pool_init(pool, p, pgcount);
+    if (ret != OK) {
+        free(pool->split_map);
+        free(pool->free_map);
+        free(pool->zero_map);
+        free(pool->order);
+        free(pool->sum_map);
+        free(pool->pb_type);
+        free(pool);
+        return ERR_PTR(ret);
+    }
+    return pool;
+}
 
-        rank++;
-        index = PARENT(index);
+// run the reclaim callbacks until `wmark_high` pages are free or a round frees none
+static void reclaim(buddy_pool_t *pool) {
+    reclaim_t cbs[MAX_RECLAIM];
+    if (__atomic_exchange_n(&pool->reclaiming, 1, __ATOMIC_ACQUIRE)) return;
+    pthread_mutex_lock(&pool->wmark_lock);
+    int n = pool->reclaim_num;
+    for (int i = 0; i < n; ++i) cbs[i] = pool->reclaim[i];
+    long high = pool->wmark_high;
+    pthread_mutex_unlock(&pool->wmark_lock);
+
+    long freed, total = 0;
+    do {
+        freed = 0;
+        for (int i = 0; i < n; ++i) {
+            long want = high - __atomic_load_n(&pool->free_pages, __ATOMIC_RELAXED);
+            if (want <= 0) break;
+            long got = cbs[i].fn(want, cbs[i].arg);
+            if (got > 0) freed += got;
+        }
+        total += freed;
+    } while (freed > 0 && __atomic_load_n(&pool->free_pages, __ATOMIC_RELAXED) < high);
+    __atomic_add_fetch(&pool->reclaims, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->reclaimed, total, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->reclaiming, 0, __ATOMIC_RELEASE);
+}
+
+static void *reclaimd(void *arg) {
+    buddy_pool_t *pool = arg;
+    pthread_mutex_lock(&pool->wmark_lock);
+    while (!pool->reclaimd_stop) {
+        if (!pool->reclaimd_wake) {
+            pthread_cond_wait(&pool->wmark_cond, &pool->wmark_lock);
+            continue;
+        }
+        pool->reclaimd_wake = false;
+        pthread_mutex_unlock(&pool->wmark_lock);
+        reclaim(pool);
+        pthread_mutex_lock(&pool->wmark_lock);
+    }
+    pthread_mutex_unlock(&pool->wmark_lock);
+    return NULL;
+}
+
+// stop the background thread, with wmark_lock held
+static void reclaimd_stop(buddy_pool_t *pool) {
+    if (!pool->reclaimd_on) return;
+    pool->reclaimd_stop = true;
+    pthread_cond_signal(&pool->wmark_cond);
+    pthread_mutex_unlock(&pool->wmark_lock);
+    pthread_join(pool->reclaimd, NULL);
+    pthread_mutex_lock(&pool->wmark_lock);
+    pool->reclaimd_on = false;
+}
+
+// reclaim, or have it done, if `pages` more pages used would cross a watermark
+static void watermark_check(buddy_pool_t *pool, long pages) {
+    long low = __atomic_load_n(&pool->wmark_low, __ATOMIC_RELAXED);
+    if (low == 0) return;
+    long left = __atomic_load_n(&pool->free_pages, __ATOMIC_RELAXED) - pages;
+    if (left >= low || __atomic_load_n(&pool->reclaiming, __ATOMIC_RELAXED)) return;
+    if (left >= __atomic_load_n(&pool->wmark_min, __ATOMIC_RELAXED) &&
+        __atomic_load_n(&pool->reclaimd_on, __ATOMIC_RELAXED)) {
+        if (__atomic_load_n(&pool->reclaimd_wake, __ATOMIC_RELAXED)) return;
+        pthread_mutex_lock(&pool->wmark_lock);
+        pool->reclaimd_wake = true;
+        pthread_cond_signal(&pool->wmark_cond);
+        pthread_mutex_unlock(&pool->wmark_lock);
+        return;
+    }
+    reclaim(pool);
+}
+
+// free pages in zeroed blocks
+static uint64_t zero_pages(buddy_pool_t *pool) {
+    uint64_t pages = 0;
+    for (uint8_t rank = 1; rank <= RANK_NUM(pool); ++rank)
+        pages += __atomic_load_n(&pool->zero_count[rank], __ATOMIC_RELAXED) << (rank - 1);
+    return pages;
+}
+
+// give the block being zeroed back, waking those that missed it
+static void zero_done(buddy_pool_t *pool) {
+    pthread_mutex_lock(&pool->zero_lock);
+    __atomic_add_fetch(&pool->zeroing, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->zero_cond);
+    pthread_mutex_unlock(&pool->zero_lock);
+}
+
+/*
+ * Zero the largest free block of unknown contents, or a block of ZERO_RANK cut
+ * from it, and free it as zeroed. Return its pages, or 0 if there was none or
+ * taking it would cross the low watermark.
+ */
+static long zero_block(buddy_pool_t *pool) {
+    uint64_t dirty = 0;
+    int type = 0;
+    for (int t = 0; t < MIGRATE_TYPES; ++t) {
+        uint64_t mask = __atomic_load_n(&pool->free_mask[t], __ATOMIC_RELAXED);
+        if (mask > dirty) dirty = mask, type = t;
+    }
+    if (dirty == 0) return 0;
+    uint8_t rank = 63 - __builtin_clzll(dirty);
+    if (rank > ZERO_RANK) rank = ZERO_RANK;
+    long pages = 1l << (rank - 1);
+    long low = __atomic_load_n(&pool->wmark_low, __ATOMIC_RELAXED);
+    if (low != 0 && __atomic_load_n(&pool->free_pages, __ATOMIC_RELAXED) - pages < low) return 0;
+    __atomic_add_fetch(&pool->zeroing, 1, __ATOMIC_SEQ_CST);
+    void *p = _alloc_pages(pool, rank, type, false, false);
+    if (IS_ERR(p)) {
+        zero_done(pool);
+        return 0;
+    }
+    pfn_t page = ptr_to_page(pool, p);
+    // not to be moved by compaction meanwhile
+    pool->order[page] = rank | ORDER_CACHED;
+    clear_pages(p, (size_t)PAGE_SIZE << (rank - 1));
+    lock_rank(pool, rank);
+    free_block(pool, page, rank, true);
+    unlock_rank(pool, rank);
+    zero_done(pool);
+    lazy_settle(pool);
+    __atomic_add_fetch(&pool->prezeroed, pages, __ATOMIC_RELAXED);
+    return pages;
+}
+
+static void *zerod(void *arg) {
+    buddy_pool_t *pool = arg;
+    pthread_mutex_lock(&pool->zero_lock);
+    while (!pool->zerod_stop) {
+        long target = pool->zero_target;
+        pthread_mutex_unlock(&pool->zero_lock);
+        long zeroed = zero_pages(pool) < (uint64_t)target? zero_block(pool): 0;
+        pthread_mutex_lock(&pool->zero_lock);
+        if (zeroed != 0 || pool->zerod_stop) continue;
+        // merges with other blocks lose zeroed pages unnoticed, so look again now and then
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += ZERO_POLL * 1000000l;
+        if (until.tv_nsec >= 1000000000l) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000l;
+        }
+        pthread_cond_timedwait(&pool->zero_cond, &pool->zero_lock, &until);
+    }
+    pthread_mutex_unlock(&pool->zero_lock);
+    return NULL;
+}
+
+// stop the zeroing thread, with zero_lock held
+static void zerod_stop(buddy_pool_t *pool) {
+    if (!pool->zerod_on) return;
+    pool->zerod_stop = true;
+    pthread_cond_broadcast(&pool->zero_cond);
+    pthread_mutex_unlock(&pool->zero_lock);
+    pthread_join(pool->zerod, NULL);
+    pthread_mutex_lock(&pool->zero_lock);
+    pool->zerod_on = false;
+}
+
+// not thread-safe: no other call on the pool may run concurrently
+void buddy_pool_destroy(buddy_pool_t *pool) {
+    if (pool == NULL || pool == &default_pool) return;
+    pthread_mutex_lock(&pool->wmark_lock);
+    reclaimd_stop(pool);
+    pthread_mutex_unlock(&pool->wmark_lock);
+    pthread_mutex_lock(&pool->zero_lock);
+    zerod_stop(pool);
+    pthread_mutex_unlock(&pool->zero_lock);
+    pthread_key_delete(pool->pcp_key);
+    for (pcp_t *pc = pool->pcp_list, *next; pc != NULL; pc = next) {
+        next = pc->next;
+        free(pc);
+    }
+    free(pool->split_map);
+    free(pool->free_map);
+    free(pool->zero_map);
+    free(pool->order);
+    free(pool->sum_map);
+    free(pool->pb_type);
+    free(pool);
+}
+
+int buddy_pool_set_fallback(buddy_pool_t *pool, buddy_pool_t **zonelist, int n) {
+    if (n < 0 || n > MAX_FALLBACK) return -EINVAL;
+    for (int i = 0; i < n; ++i)
+        if (zonelist[i] == NULL || zonelist[i] == pool) return -EINVAL;
+    for (int i = 0; i < n; ++i) pool->fallback[i] = zonelist[i];
+    pool->fallback_num = n;
+    return OK;
+}
+
+// the pool among `pool` and its fallbacks that manages `p`
+static buddy_pool_t *owner_pool(buddy_pool_t *pool, void *p) {
+    if (is_valid_ptr(pool, p)) return pool;
+    for (int i = 0; i < pool->fallback_num; ++i)
+        if (is_valid_ptr(pool->fallback[i], p)) return pool->fallback[i];
+    return NULL;
+}
+
+static void *pool_alloc(buddy_pool_t *pool, int rank, int type, bool zero) {
+    if (rank < 1 || rank > (int)RANK_NUM(pool)) return (void*)-EINVAL;
+    // without grouping all blocks are alike
+    if (pool->pb_rank == 0) type = PAGE_UNMOVABLE;
+    uint32_t feat = FEATURES(pool);
+    // below min, reclaim before the pages are taken
+    if ((feat & FEAT_WMARK) &&
+        __atomic_load_n(&pool->free_pages, __ATOMIC_RELAXED) - (1l << (rank - 1)) <
+        __atomic_load_n(&pool->wmark_min, __ATOMIC_RELAXED))
+        watermark_check(pool, 1l << (rank - 1));
+    // per-thread caches and the lock-free stack hold unmovable pages of unknown contents only
+    void *ret;
+    bool single = rank == 1 && type == PAGE_UNMOVABLE && !zero;
+    if (single && (feat & FEAT_PCP))
+        ret = pcp_alloc(pool);
+    else if (single && (feat & FEAT_LF))
+        ret = lf_alloc(pool);
+    else {
+        bool held = solo_enter();
+        ret = _alloc_pages(pool, rank, type, zero, true);
+        solo_leave(held);
+    }
+    if (IS_ERR(ret)) return ret;
+    if (feat & FEAT_WMARK) watermark_check(pool, 0);
+    // have the zeroed pages taken made up for
+    if (zero && (feat & FEAT_ZEROD) &&
+        zero_pages(pool) < (uint64_t)__atomic_load_n(&pool->zero_target, __ATOMIC_RELAXED)) {
+        // allocators waiting for a block being zeroed share the condition
+        pthread_mutex_lock(&pool->zero_lock);
+        pthread_cond_broadcast(&pool->zero_cond);
+        pthread_mutex_unlock(&pool->zero_lock);
+    }
+    return ret;
+}
+
+static void *alloc_from(buddy_pool_t *pool, int rank, int type, bool zero) {
+    void *ret = pool_alloc(pool, rank, type, zero);
+    for (int i = 0; i < pool->fallback_num && IS_ERR(ret); ++i) {
+        void *r = pool_alloc(pool->fallback[i], rank, type, zero);
+        // running out of pages is reported over an unsupported rank
+        if (!IS_ERR(r) || PTR_ERR(r) == -ENOSPC) ret = r;
+    }
+    // pages on the lock-free stack may make up a larger block
+    if (PTR_ERR(ret) == -ENOSPC && rank > 1 && __atomic_load_n(&pool->lf_count, __ATOMIC_RELAXED)) {
+        lf_drain(pool, 0);
+        ret = pool_alloc(pool, rank, type, zero);
+    }
+    // a large block may yet be made up by moving others out of the way
+    for (int i = -1; i < pool->fallback_num && PTR_ERR(ret) == -ENOSPC && rank > 1; ++i) {
+        buddy_pool_t *zone = i < 0? pool: pool->fallback[i];
+        if (!zone->compact_auto || rank > (int)RANK_NUM(zone)) continue;
+        if (compact(zone, rank, false) >= 0) ret = pool_alloc(zone, rank, type, zero);
+    }
+    if (PTR_ERR(ret) == -ENOSPC)
+        __atomic_add_fetch(&pool->alloc_fails[rank], 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+void *buddy_pool_alloc(buddy_pool_t *pool, int rank) {
+    return alloc_from(pool, rank, PAGE_UNMOVABLE, false);
+}
+
+void *buddy_pool_alloc_type(buddy_pool_t *pool, int rank, int type) {
+    if (type < 0 || type >= MIGRATE_TYPES) return (void*)-EINVAL;
+    return alloc_from(pool, rank, type, false);
+}
+
+void *buddy_pool_alloc_zeroed(buddy_pool_t *pool, int rank) {
+    return alloc_from(pool, rank, PAGE_UNMOVABLE, true);
+}
+
+int buddy_pool_free(buddy_pool_t *pool, void *p) {
+    pool = owner_pool(pool, p);
+    if (pool == NULL) return -EINVAL;
+    pfn_t page = ptr_to_page(pool, p);
+    uint8_t rank = pool->order[page];
+    // before the page is cached or stacked, where it would be handed out again at once
+    if (!is_used(pool, page, rank)) return -EINVAL;
+
+    uint32_t feat = FEATURES(pool);
+    bool cacheable = rank == 1 && (feat & (FEAT_PCP | FEAT_LF)) &&
+        block_type(pool, page) == PAGE_UNMOVABLE;
+    if (cacheable && (feat & FEAT_PCP)) {
+        pcp_t *pc = this_pcp(pool);
+        if (pc != NULL) {
+            pcp_cache(pc, p);
+            if (pc->count > pool->pcp_high) {
+                pcp_shrink(pc, pool->pcp_low);
+                lazy_settle(pool);
+            }
+            return OK;
+        }
+    }
+    if (cacheable && (feat & FEAT_LF)) {
+        lf_free(pool, page);
+        return OK;
+    }
+
+    bool held = solo_enter();
+    lock_rank(pool, rank);
+    // a racing free of the same block may have got the lock first
+    bool used = pool->order[page] == rank;
+    if (used) free_block(pool, page, rank, false);
+    unlock_rank(pool, rank);
+    lazy_settle(pool);
+    solo_leave(held);
+    return used? OK: -EINVAL;
+}
+
+int buddy_pool_alloc_bulk(buddy_pool_t *pool, int rank, int n, void **out) {
+    if (n <= 0) return 0;
+    int got = 0;
+    for (int i = -1; i < pool->fallback_num && got < n; ++i) {
+        buddy_pool_t *zone = i < 0? pool: pool->fallback[i];
+        if (rank < 1 || rank > (int)RANK_NUM(zone)) continue;
+        bool held = solo_enter();
+        got += _alloc_bulk(zone, rank, PAGE_UNMOVABLE, n - got, out + got);
+        solo_leave(held);
+        watermark_check(zone, 0);
+    }
+    if (got < n && rank >= 1 && rank <= (int)MAX_RANK_NUM)
+        __atomic_add_fetch(&pool->alloc_fails[rank], 1, __ATOMIC_RELAXED);
+    return got;
+}
+
+typedef struct bulk_t bulk_t;
+
+struct bulk_t {
+    int zone;
+    pfn_t page;
+    uint8_t rank;
+};
+
+static int bulk_cmp(const void *a, const void *b) {
+    const bulk_t *x = a, *y = b;
+    if (x->zone != y->zone) return x->zone - y->zone;
+    return (x->page > y->page) - (x->page < y->page);
+}
+
+int buddy_pool_free_bulk(buddy_pool_t *pool, void **ptrs, int n) {
+    if (n <= 0) return 0;
+    bulk_t *blk = malloc(n * sizeof(bulk_t));
+    if (blk == NULL) {
+        // no room to sort, fall back to freeing one by one
+        int freed = 0;
+        for (int i = 0; i < n; ++i) freed += buddy_pool_free(pool, ptrs[i]) == OK;
+        return freed;
+    }
+
+    int cnt = 0;
+    for (int i = 0; i < n; ++i) {
+        buddy_pool_t *zone = owner_pool(pool, ptrs[i]);
+        if (zone == NULL) continue;
+        pfn_t page = ptr_to_page(zone, ptrs[i]);
+        uint8_t rank = zone->order[page];
+        if (!is_used(zone, page, rank)) continue;
+        int z = -1;
+        while (z >= 0? zone != pool->fallback[z]: zone != pool) ++z;
+        blk[cnt++] = (bulk_t) {z, page, rank};
+    }
+    qsort(blk, cnt, sizeof(bulk_t), bulk_cmp);
+
+    // sweep runs of adjacent blocks, each freed as few large blocks as possible
+    int freed = 0;
+    for (int i = 0, j; i < cnt; i = j) {
+        buddy_pool_t *zone = blk[i].zone < 0? pool: pool->fallback[blk[i].zone];
+        pfn_t start = blk[i].page, end = start + ((pfn_t)1 << (blk[i].rank - 1));
+        zone->order[start] = 0;
+        for (j = i + 1; j < cnt && blk[j].zone == blk[i].zone && blk[j].page <= end; ++j) {
+            // the same block listed twice
+            if (blk[j].page < end) continue;
+            end += (pfn_t)1 << (blk[j].rank - 1);
+            zone->order[blk[j].page] = 0;
+            freed++;
+        }
+        bool held = solo_enter();
+        free_range(zone, start, end);
+        solo_leave(held);
+        freed++;
+    }
+    free(blk);
+    lazy_settle(pool);
+    for (int i = 0; i < pool->fallback_num; ++i) lazy_settle(pool->fallback[i]);
+    return freed;
+}
+
+void *buddy_pool_alloc_contig(buddy_pool_t *pool, long npages) {
+    if (npages < 1 || npages > (long)MAX_PAGE_NUM) return (void*)-EINVAL;
+    // the smallest rank holding `npages`
+    uint8_t rank = npages == 1? 1: _log2(npages - 1) + 2;
+    void *ret = (void*)-EINVAL;
+    for (int i = -1; i < pool->fallback_num; ++i) {
+        buddy_pool_t *zone = i < 0? pool: pool->fallback[i];
+        if (rank > RANK_NUM(zone)) continue;
+        bool held = solo_enter();
+        ret = _alloc_pages(zone, rank, PAGE_UNMOVABLE, false, true);
+        if (!IS_ERR(ret) && (pfn_t)npages < (pfn_t)1 << (rank - 1)) {
+            pfn_t page = ptr_to_page(zone, ret);
+            trim_block(zone, page, rank, page + npages);
+        }
+        solo_leave(held);
+        if (IS_ERR(ret)) continue;
+        watermark_check(zone, 0);
+        return ret;
+    }
+    if (PTR_ERR(ret) == -ENOSPC)
+        __atomic_add_fetch(&pool->alloc_fails[rank], 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+int buddy_pool_free_contig(buddy_pool_t *pool, void *p, long npages) {
+    pool = owner_pool(pool, p);
+    if (pool == NULL || npages < 1) return -EINVAL;
+    pfn_t page = ptr_to_page(pool, p), end = page + npages;
+    if (end > pool->page_num) return -EINVAL;
+    // the run must be made of exactly the blocks it was handed out as
+    for (pfn_t head = page; head < end; ) {
+        uint8_t rank = max_rank(pool, head, end);
+        if (!is_used(pool, head, rank)) return -EINVAL;
+        head += (pfn_t)1 << (rank - 1);
     }
+    bool held = solo_enter();
+    free_range(pool, page, end);
+    lazy_settle(pool);
+    solo_leave(held);
+    return OK;
+}
+
+int buddy_pool_query_ranks(buddy_pool_t *pool, void *p) {
+    pool = owner_pool(pool, p);
+    if (pool == NULL) return -EINVAL;
+    pfn_t page = ptr_to_page(pool, p);
+    uint8_t rank = ORDER_RANK(pool->order[page]);
+    return is_block(pool, page, rank)? rank: -EINVAL;
+}
+
+int buddy_pool_query_page_counts(buddy_pool_t *pool, int rank) {
+    if (rank < 1 || rank > (int)RANK_NUM(pool)) return -EINVAL;
+    uint64_t count = __atomic_load_n(&pool->count[rank], __ATOMIC_RELAXED);
+    return count < INT32_MAX? count: INT32_MAX;
+}
+
+/*
+ * Read from the free block counts and counters kept along the way, so it takes
+ * a pass over the ranks and no lock. Counts of different ranks may be read a
+ * few operations apart, and pages held by per-thread caches count as used.
+ */
+int buddy_pool_stats(buddy_pool_t *pool, struct buddy_stats *stats) {
+    if (pool == NULL || stats == NULL || pool->base_ptr == NULL) return -EINVAL;
+    stats->rank_num = RANK_NUM(pool);
+    stats->total_pages = __atomic_load_n(&pool->present, __ATOMIC_RELAXED);
+    stats->free_pages = 0;
+    stats->largest_free = 0;
+    uint64_t blocks = 0;
+    for (int rank = 1; rank <= stats->rank_num; ++rank) {
+        uint64_t count = __atomic_load_n(&pool->count[rank], __ATOMIC_RELAXED);
+        stats->free_blocks[rank] = count;
+        stats->rank_free_pages[rank] = count << (rank - 1);
+        stats->free_pages += count << (rank - 1);
+        stats->alloc_fails[rank] = __atomic_load_n(&pool->alloc_fails[rank], __ATOMIC_RELAXED);
+        if (count != 0) stats->largest_free = rank;
+        blocks += count;
+    }
+    stats->splits = __atomic_load_n(&pool->splits, __ATOMIC_RELAXED);
+    stats->merges = __atomic_load_n(&pool->merges, __ATOMIC_RELAXED);
+    stats->steals = __atomic_load_n(&pool->steals, __ATOMIC_RELAXED);
+    stats->migrations = __atomic_load_n(&pool->migrations, __ATOMIC_RELAXED);
+    stats->reclaims = __atomic_load_n(&pool->reclaims, __ATOMIC_RELAXED);
+    stats->reclaimed = __atomic_load_n(&pool->reclaimed, __ATOMIC_RELAXED);
+    stats->zero_pages = zero_pages(pool);
+    stats->prezeroed = __atomic_load_n(&pool->prezeroed, __ATOMIC_RELAXED);
+    stats->zero_fills = __atomic_load_n(&pool->zero_fills, __ATOMIC_RELAXED);
 
-    node = &meta[block_to_page(index, rank)];
-    node->status = UNUSED;
-    node->rank = rank;
-    node->index = index;
-    list_push(bucket[rank], node);
-    count[rank]++;
+    /*
+     * The fragmentation index of Linux, in thousandths: towards 0 a request of
+     * the rank fails for want of memory, towards 1000 for want of a large enough
+     * block. Ranks with a free block to spare are at -1000.
+     */
+    uint64_t below = 0;
+    for (int rank = 1; rank <= stats->rank_num; ++rank) {
+        uint64_t requested = 1ull << (rank - 1);
+        if (blocks == 0) stats->frag_index[rank] = 0;
+        else if (rank <= stats->largest_free) stats->frag_index[rank] = -1000;
+        else stats->frag_index[rank] =
+            1000 - (1000 + stats->free_pages * 1000 / requested) / blocks;
+        // share of the free pages in blocks too small for the rank
+        stats->unusable_index[rank] = stats->free_pages == 0? 0:
+            below * 1000 / stats->free_pages;
+        below += stats->rank_free_pages[rank];
+    }
+    return OK;
+}
 
+int buddy_pool_dump(buddy_pool_t *pool, FILE *out) {
+    struct buddy_stats st;
+    int ret = buddy_pool_stats(pool, &st);
+    if (ret != OK) return ret;
+    fprintf(out, "%lu pages, %lu free, largest free block of rank %d\n",
+            (unsigned long)st.total_pages, (unsigned long)st.free_pages, st.largest_free);
+    fprintf(out, "%lu splits, %lu merges, %lu steals, %lu migrations\n",
+            (unsigned long)st.splits, (unsigned long)st.merges, (unsigned long)st.steals,
+            (unsigned long)st.migrations);
+    fprintf(out, "%lu reclaim runs, %lu pages reclaimed\n", (unsigned long)st.reclaims,
+            (unsigned long)st.reclaimed);
+    fprintf(out, "%lu free pages zeroed, %lu zeroed in the background, %lu on allocation\n",
+            (unsigned long)st.zero_pages, (unsigned long)st.prezeroed,
+            (unsigned long)st.zero_fills);
+    fprintf(out, "rank  free blocks   free pages  unusable  fragmentation  failures\n");
+    for (int rank = 1; rank <= st.rank_num; ++rank) {
+        fprintf(out, "%4d %12lu %12lu %8.3f %14.3f %9lu\n", rank,
+                (unsigned long)st.free_blocks[rank], (unsigned long)st.rank_free_pages[rank],
+                st.unusable_index[rank] / 1000.0, st.frag_index[rank] / 1000.0,
+                (unsigned long)st.alloc_fails[rank]);
+    }
     return OK;
 }
 
+int buddy_pool_pcp_config(buddy_pool_t *pool, int high, int low, int batch) {
+    if (high < 0 || low < 0 || low > high) return -EINVAL;
+    if (high > 0 && (batch < 1 || batch > high)) return -EINVAL;
+    bool held = solo_enter();
+    lock_rank(pool, 1);
+    pool->pcp_low = low;
+    pool->pcp_batch = batch;
+    __atomic_store_n(&pool->pcp_high, high, __ATOMIC_RELEASE);
+    set_feature(pool, FEAT_PCP, high != 0);
+    unlock_rank(pool, 1);
+    solo_leave(held);
+    return OK;
+}
+
+void buddy_pool_pcp_drain(buddy_pool_t *pool) {
+    pcp_t *pc = pthread_getspecific(pool->pcp_key);
+    if (pc != NULL) pcp_shrink(pc, 0);
+    lazy_settle(pool);
+}
+
+int buddy_pool_lockfree(buddy_pool_t *pool, int high, int batch) {
+    if (high < 0 || (high > 0 && (batch < 1 || batch > high))) return -EINVAL;
+    bool held = solo_enter();
+    lock_rank(pool, 1);
+    pool->lf_batch = batch;
+    __atomic_store_n(&pool->lf_high, high, __ATOMIC_RELEASE);
+    set_feature(pool, FEAT_LF, high != 0);
+    unlock_rank(pool, 1);
+    solo_leave(held);
+    // start over empty
+    lf_drain(pool, 0);
+    lazy_settle(pool);
+    return OK;
+}
+
+int buddy_pool_addr_order(buddy_pool_t *pool, unsigned long ranks) {
+    int ret = OK;
+    // regions are not added meanwhile, the summaries cover the whole layout
+    pthread_mutex_lock(&pool->region_lock);
+    bool held = solo_enter();
+    lock_ranks(pool, pool->rank_num);
+    if (ranks != 0) ret = sum_setup(pool, pool->meta_ranks, ranks);
+    if (ret == OK) {
+        pool->addr_mask = ranks;
+        // the free bits of the new ranks were cleared, set them back from the lists
+        addr_relist(pool);
+    }
+    unlock_ranks(pool, pool->rank_num);
+    solo_leave(held);
+    pthread_mutex_unlock(&pool->region_lock);
+    return ret;
+}
+
+int buddy_pool_watermarks(buddy_pool_t *pool, long min, long low, long high,
+                          int background) {
+    if (min < 0 || min > low || low > high || (low == 0 && high != 0)) return -EINVAL;
+    pthread_mutex_lock(&pool->wmark_lock);
+    reclaimd_stop(pool);
+    __atomic_store_n(&pool->wmark_min, min, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->wmark_high, high, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->wmark_low, low, __ATOMIC_RELAXED);
+    set_feature(pool, FEAT_WMARK, low != 0);
+    int ret = OK;
+    if (low != 0 && background) {
+        pool->reclaimd_stop = pool->reclaimd_wake = false;
+        if (pthread_create(&pool->reclaimd, NULL, reclaimd, pool) == 0)
+            __atomic_store_n(&pool->reclaimd_on, true, __ATOMIC_RELAXED);
+        else
+            ret = -ENOMEM;
+    }
+    pthread_mutex_unlock(&pool->wmark_lock);
+    return ret;
+}
+
+int buddy_pool_register_reclaim(buddy_pool_t *pool, long (*fn)(long pages, void *arg),
+                                void *arg) {
+    if (fn == NULL) return -EINVAL;
+    int ret = -ENOSPC;
+    pthread_mutex_lock(&pool->wmark_lock);
+    if (pool->reclaim_num < MAX_RECLAIM) {
+        pool->reclaim[pool->reclaim_num++] = (reclaim_t) {fn, arg};
+        ret = OK;
+    }
+    pthread_mutex_unlock(&pool->wmark_lock);
+    return ret;
+}
+
+int buddy_pool_unregister_reclaim(buddy_pool_t *pool, long (*fn)(long pages, void *arg),
+                                  void *arg) {
+    int ret = -EINVAL;
+    pthread_mutex_lock(&pool->wmark_lock);
+    for (int i = 0; i < pool->reclaim_num; ++i) {
+        if (pool->reclaim[i].fn != fn || pool->reclaim[i].arg != arg) continue;
+        for (int j = i + 1; j < pool->reclaim_num; ++j) pool->reclaim[j - 1] = pool->reclaim[j];
+        pool->reclaim_num--;
+        ret = OK;
+        break;
+    }
+    pthread_mutex_unlock(&pool->wmark_lock);
+    return ret;
+}
+
+int buddy_pool_prezero(buddy_pool_t *pool, long target) {
+    if (target < 0) return -EINVAL;
+    pthread_mutex_lock(&pool->zero_lock);
+    zerod_stop(pool);
+    // no bit was written so far, every free block is of unknown contents
+    if (target != 0 && !pool->zero_track) {
+        if (pool->zero_map != NULL) memset(pool->zero_map, 0, pool->map_off[pool->meta_ranks + 1] / 8);
+        __atomic_store_n(&pool->zero_track, true, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&pool->zero_target, target, __ATOMIC_RELAXED);
+    int ret = OK;
+    if (target != 0) {
+        pool->zerod_stop = false;
+        if (pthread_create(&pool->zerod, NULL, zerod, pool) == 0)
+            __atomic_store_n(&pool->zerod_on, true, __ATOMIC_RELAXED);
+        else
+            ret = -ENOMEM;
+    }
+    set_feature(pool, FEAT_ZEROD, pool->zerod_on);
+    pthread_mutex_unlock(&pool->zero_lock);
+    return ret;
+}
+
+int buddy_pool_compact_config(buddy_pool_t *pool,
+                              int (*migrate)(void *from, void *to, int rank, void *arg),
+                              void *arg, int automatic) {
+    if (migrate == NULL && automatic) return -EINVAL;
+    pthread_mutex_lock(&pool->compact_lock);
+    pool->migrate = migrate;
+    pool->migrate_arg = arg;
+    pool->compact_auto = automatic != 0;
+    pthread_mutex_unlock(&pool->compact_lock);
+    return OK;
+}
+
+int buddy_pool_compact(buddy_pool_t *pool, int rank) {
+    if (rank < 1 || rank > (int)RANK_NUM(pool) || pool->migrate == NULL) return -EINVAL;
+    return compact(pool, rank, true);
+}
+
+/*
+ * Cut the pages [page, end), lying in used blocks owned by the caller, into used
+ * blocks of maximal rank, marked as a hole if `hole` is set.
+ */
+static void cut_used(buddy_pool_t *pool, pfn_t page, pfn_t end, bool hole) {
+    while (page < end) {
+        uint8_t rank = max_rank(pool, page, end);
+        // split up to the block it is cut from, above which all are split already
+        for (uint8_t r = rank + 1; r <= pool->rank_num; ++r) {
+            uint64_t bit = BIT(pool, r, page >> (r - 1));
+            SET_BIT(pool->split_map, bit);
+            CLEAR_BIT(pool->free_map, bit);
+        }
+        uint64_t bit = BIT(pool, rank, page >> (rank - 1));
+        CLEAR_BIT(pool->split_map, bit);
+        CLEAR_BIT(pool->free_map, bit);
+        pool->order[page] = rank | (hole? ORDER_CACHED: 0);
+        page += (pfn_t)1 << (rank - 1);
+    }
+}
+
+/*
+ * Grow the span to `end` pages within the layout, the pages added being a hole,
+ * with the ranks up to those of the new span locked.
+ */
+static void grow_span(buddy_pool_t *pool, pfn_t end) {
+    uint32_t rank_num = _log2(end) + 1;
+    // the old roots descend from the first block of each new rank
+    for (uint8_t rank = pool->rank_num + 1; rank <= rank_num; ++rank) {
+        uint64_t bit = BIT(pool, rank, 0);
+        SET_BIT(pool->split_map, bit);
+        CLEAR_BIT(pool->free_map, bit);
+    }
+    __atomic_store_n(&pool->rank_num, rank_num, __ATOMIC_RELEASE);
+    cut_used(pool, pool->page_num, end, true);
+    __atomic_store_n(&pool->page_num, end, __ATOMIC_RELEASE);
+    seal_tail(pool);
+}
+
+// the rank of the existing block holding `page`, found from the roots down
+static uint8_t block_at(buddy_pool_t *pool, pfn_t page) {
+    uint8_t rank = pool->rank_num;
+    while (rank > 1 && TEST_BIT(pool->split_map, BIT(pool, rank, page >> (rank - 1)))) rank--;
+    return rank;
+}
+
+/*
+ * Cut the pages [start, end) out as a hole if the blocks over them are all
+ * free, and give back the rest of those blocks; return whether they were.
+ */
+static bool isolate(buddy_pool_t *pool, pfn_t start, pfn_t end) {
+    uint32_t ranks = pool->rank_num;
+    pfn_t first = start, last = start;
+    lock_ranks(pool, ranks);
+    while (last < end) {
+        uint8_t rank = block_at(pool, last);
+        pfn_t page = last & ~(((pfn_t)1 << (rank - 1)) - 1);
+        if (!TEST_BIT(pool->free_map, BIT(pool, rank, page >> (rank - 1)))) {
+            unlock_ranks(pool, ranks);
+            return false;
+        }
+        if (last == start) first = page;
+        last = page + ((pfn_t)1 << (rank - 1));
+    }
+    for (pfn_t page = first; page < last; ) {
+        uint8_t rank = block_at(pool, page);
+        remove_block(pool, page, rank);
+        page += (pfn_t)1 << (rank - 1);
+    }
+    account(pool, -(int64_t)(last - first));
+    cut_used(pool, first, start, false);
+    cut_used(pool, start, end, true);
+    cut_used(pool, end, last, false);
+    unlock_ranks(pool, ranks);
+    free_range(pool, first, start);
+    free_range(pool, end, last);
+    return true;
+}
+
+/*
+ * Move the used blocks over [start, end) elsewhere with the compaction callback,
+ * return whether none was left behind for good. Blocks held by per-thread caches
+ * or the zeroing thread, or being split or merged, are left for another look.
+ */
+static bool evacuate(buddy_pool_t *pool, pfn_t start, pfn_t end) {
+    bool ok = true;
+    int moved = 0;
+    pthread_mutex_lock(&pool->compact_lock);
+    if (pool->migrate == NULL) ok = false;
+    for (pfn_t head = start; ok && head < end; ) {
+        uint8_t rank = block_at(pool, head);
+        pfn_t size = (pfn_t)1 << (rank - 1), page = head & ~(size - 1);
+        head = page + size;
+        if (!is_used(pool, page, rank)) continue;
+        if (pool->pb_rank != 0 && block_type(pool, page) != PAGE_MOVABLE) ok = false;
+        int64_t to = ok? take_outside(pool, rank, start, end): -1;
+        if (to < 0) {
+            ok = false;
+            break;
+        }
+        if (pool->migrate(page_to_ptr(pool, page), page_to_ptr(pool, to), rank,
+                          pool->migrate_arg) != OK) {
+            page = to;
+            ok = false;
+        } else {
+            moved++;
+        }
+        lock_rank(pool, rank);
+        free_block(pool, page, rank, false);
+        unlock_rank(pool, rank);
+    }
+    __atomic_add_fetch(&pool->migrations, moved, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool->compact_lock);
+    lazy_settle(pool);
+    return ok;
+}
+
+// the pages [start, end) of a region at `p` of `pgcount` pages, or -EINVAL
+static int region_pages(buddy_pool_t *pool, void *p, long pgcount, pfn_t *start, pfn_t *end) {
+    if (pgcount < 1 || pool->base_ptr == NULL || p < pool->base_ptr ||
+        (p - pool->base_ptr) % PAGE_SIZE != 0)
+        return -EINVAL;
+    *start = ptr_to_page(pool, p);
+    *end = *start + pgcount;
+    return _log2(*end) + 1u > MAX_RANK_NUM? -EINVAL: OK;
+}
+
+// not thread-safe if the span outgrows the layout: no other call may run then
+int buddy_pool_add_region(buddy_pool_t *pool, void *p, long pgcount) {
+    if (p == NULL || pgcount < 1) return -EINVAL;
+    pthread_mutex_lock(&pool->region_lock);
+    if (pool->base_ptr == NULL) {
+        int ret = pool_init(pool, p, pgcount);
+        pthread_mutex_unlock(&pool->region_lock);
+        return ret;
+    }
+    pfn_t start, end;
+    int ret = region_pages(pool, p, pgcount, &start, &end);
+    int i = 0;
+    while (ret == OK && i < pool->region_num && pool->region[i].end <= start) ++i;
+    if (ret == OK && i < pool->region_num && pool->region[i].start < end) ret = -EINVAL;
+    if (ret == OK && pool->region_num == MAX_REGIONS) ret = -ENOSPC;
+    if (ret == OK && end > pool->meta_cap) {
+        // at least twofold, so that the buffers rarely move
+        pfn_t span = pool->meta_cap * 2 > end? pool->meta_cap * 2: end;
+        ret = meta_grow(pool, _log2(span) + 1u > MAX_RANK_NUM? end: span);
+    }
+    if (ret != OK) {
+        pthread_mutex_unlock(&pool->region_lock);
+        return ret;
+    }
+
+    uint32_t ranks = end > pool->page_num? _log2(end) + 1u: pool->rank_num;
+    bool held = solo_enter();
+    lock_ranks(pool, ranks);
+    if (end > pool->page_num) grow_span(pool, end);
+    // the hole the region lies in is cut anew around it
+    pfn_t hole = i > 0? pool->region[i - 1].end: 0;
+    pfn_t hole_end = i < pool->region_num? pool->region[i].start: pool->page_num;
+    cut_used(pool, hole, start, true);
+    cut_used(pool, start, end, false);
+    cut_used(pool, end, hole_end, true);
+    unlock_ranks(pool, ranks);
+    free_range(pool, start, end);
+    solo_leave(held);
+
+    memmove(&pool->region[i + 1], &pool->region[i], (pool->region_num - i) * sizeof(region_t));
+    pool->region[i] = (region_t) {start, end};
+    pool->region_num++;
+    __atomic_add_fetch(&pool->present, end - start, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool->region_lock);
+    lazy_settle(pool);
+    return OK;
+}
+
+int buddy_pool_remove_region(buddy_pool_t *pool, void *p, long pgcount) {
+    pfn_t start, end;
+    pthread_mutex_lock(&pool->region_lock);
+    int ret = region_pages(pool, p, pgcount, &start, &end);
+    int i = 0;
+    while (ret == OK && i < pool->region_num &&
+           (pool->region[i].start > start || pool->region[i].end < end))
+        ++i;
+    if (ret == OK && i == pool->region_num) ret = -EINVAL;
+    region_t r = ret == OK? pool->region[i]: (region_t) {0, 0};
+    // taken out of the middle, the region is split in two
+    bool middle = r.start < start && end < r.end;
+    if (ret == OK && middle && pool->region_num == MAX_REGIONS) ret = -ENOSPC;
+    if (ret == OK) {
+        // pages the caller still caches, or stacked, count as used
+        buddy_pool_pcp_drain(pool);
+        lf_drain(pool, 0);
+        bool held = solo_enter();
+        for (int tries = 1; !isolate(pool, start, end); ++tries) {
+            if (tries == REMOVE_TRIES || !evacuate(pool, start, end)) {
+                ret = -EBUSY;
+                break;
+            }
+        }
+        solo_leave(held);
+    }
+    if (ret != OK) {
+        pthread_mutex_unlock(&pool->region_lock);
+        return ret;
+    }
+
+    if (middle) {
+        memmove(&pool->region[i + 2], &pool->region[i + 1],
+                (pool->region_num - i - 1) * sizeof(region_t));
+        pool->region[i].end = start;
+        pool->region[i + 1] = (region_t) {end, r.end};
+        pool->region_num++;
+    } else if (r.start < start) {
+        pool->region[i].end = start;
+    } else if (end < r.end) {
+        pool->region[i].start = end;
+    } else {
+        memmove(&pool->region[i], &pool->region[i + 1],
+                (pool->region_num - i - 1) * sizeof(region_t));
+        pool->region_num--;
+    }
+    __atomic_sub_fetch(&pool->present, end - start, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool->region_lock);
+    return OK;
+}
+
+// not thread-safe: no other call on the pool may run concurrently
+int buddy_pool_reserve(buddy_pool_t *pool, long pages) {
+    if (pages < 1 || _log2(pages) + 1u > MAX_RANK_NUM) return -EINVAL;
+    pthread_mutex_lock(&pool->region_lock);
+    int ret = (pfn_t)pages > pool->meta_cap? meta_grow(pool, pages): OK;
+    pthread_mutex_unlock(&pool->region_lock);
+    return ret;
+}
+
+// move the free blocks of `rank` to the lists of their current type
+static void relist(buddy_pool_t *pool, uint8_t rank) {
+    list_t *all = NULL;
+    for (int list = 0; list < FREE_LISTS; ++list) {
+        while (pool->bucket[rank][list] != NULL) {
+            list_t *node = pool->bucket[rank][list];
+            list_remove(pool, rank, list, node);
+            node->next = all;
+            all = node;
+        }
+    }
+    while (all != NULL) {
+        list_t *node = all;
+        all = node->next;
+        list_push(pool, rank, block_list(pool, ptr_to_page(pool, node), rank), node);
+    }
+}
+
+// not thread-safe: no other call on the pool may run concurrently
+int buddy_pool_mobility(buddy_pool_t *pool, int pageblock_rank) {
+    if (pageblock_rank < 0 || pageblock_rank > (int)MAX_RANK_NUM) return -EINVAL;
+    int ret = OK;
+    if (pageblock_rank != 0) ret = pb_setup(pool, pool->meta_cap, pageblock_rank, 0);
+    if (ret != OK) return ret;
+    // every pageblock starts out movable
+    pool->pb_rank = pageblock_rank;
+    for (uint8_t rank = 1; rank <= pool->rank_num; ++rank) relist(pool, rank);
+    return OK;
+}
+
+int buddy_pool_lazy_config(buddy_pool_t *pool, int limit) {
+    if (limit < 0) return -EINVAL;
+    __atomic_store_n(&pool->lazy_limit, limit, __ATOMIC_RELAXED);
+    set_feature(pool, FEAT_LAZY, limit != 0);
+    // start over with nothing owed, and nothing unmerged if merging is eager again
+    coalesce(pool);
+    return OK;
+}
+
+// the default pool backs the original single-region interface
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+static void default_setup(void) {
+    pool_setup(&default_pool);
+}
+
+buddy_pool_t *buddy_default_pool(void) {
+    pthread_once(&default_once, default_setup);
+    return &default_pool;
+}
+
+// not thread-safe: no other call may run concurrently
+int init_page(void *p, int pgcount) {
+    return pool_init(buddy_default_pool(), p, pgcount);
+}
+
+void *alloc_pages(int rank) {
+    return buddy_pool_alloc(buddy_default_pool(), rank);
+}
+
+int return_pages(void *p) {
+// printf("[dbg] offset 0x%x, validity %d\n", p - base_ptr, is_valid_ptr(p));
+    return buddy_pool_free(buddy_default_pool(), p);
+}
+
 int query_ranks(void *p) {
-    if (!is_valid_ptr(p)) return -EINVAL;
-    list_t *node = &meta[ptr_to_page(p)];
-    return node->status != UNDEF? node->rank: -EINVAL;
+    return buddy_pool_query_ranks(buddy_default_pool(), p);
 }
 
 int query_page_counts(int rank) {
-    if (rank < 1 || rank > rank_num) return -EINVAL;
-    return count[rank];
+    return buddy_pool_query_page_counts(buddy_default_pool(), rank);
+}
+
+int pcp_config(int high, int low, int batch) {
+    return buddy_pool_pcp_config(buddy_default_pool(), high, low, batch);
+}
+
+void pcp_drain(void) {
+    buddy_pool_pcp_drain(buddy_default_pool());
+}
+
+int lockfree_config(int high, int batch) {
+    return buddy_pool_lockfree(buddy_default_pool(), high, batch);
+}
+
+int addr_order_config(unsigned long ranks) {
+    return buddy_pool_addr_order(buddy_default_pool(), ranks);
+}
+
+int lazy_config(int limit) {
+    return buddy_pool_lazy_config(buddy_default_pool(), limit);
+}
+
+int alloc_pages_bulk(int rank, int n, void **out) {
+    return buddy_pool_alloc_bulk(buddy_default_pool(), rank, n, out);
+}
+
+void *alloc_pages_type(int rank, int type) {
+    return buddy_pool_alloc_type(buddy_default_pool(), rank, type);
+}
+
+int mobility_config(int pageblock_rank) {
+    return buddy_pool_mobility(buddy_default_pool(), pageblock_rank);
+}
+
+int compact_config(int (*migrate)(void *from, void *to, int rank, void *arg),
+                   void *arg, int automatic) {
+    return buddy_pool_compact_config(buddy_default_pool(), migrate, arg, automatic);
+}
+
+void *alloc_pages_zeroed(int rank) {
+    return buddy_pool_alloc_zeroed(buddy_default_pool(), rank);
+}
+
+int prezero_config(long target) {
+    return buddy_pool_prezero(buddy_default_pool(), target);
+}
+
+int watermark_config(long min, long low, long high, int background) {
+    return buddy_pool_watermarks(buddy_default_pool(), min, low, high, background);
+}
+
+int register_reclaim(long (*fn)(long pages, void *arg), void *arg) {
+    return buddy_pool_register_reclaim(buddy_default_pool(), fn, arg);
+}
+
+int unregister_reclaim(long (*fn)(long pages, void *arg), void *arg) {
+    return buddy_pool_unregister_reclaim(buddy_default_pool(), fn, arg);
+}
+
+int buddy_add_region(void *p, long pgcount) {
+    return buddy_pool_add_region(buddy_default_pool(), p, pgcount);
+}
+
+int buddy_remove_region(void *p, long pgcount) {
+    return buddy_pool_remove_region(buddy_default_pool(), p, pgcount);
+}
+
+int compact_pages(int rank) {
+    return buddy_pool_compact(buddy_default_pool(), rank);
+}
+
+int return_pages_bulk(void **ptrs, int n) {
+    return buddy_pool_free_bulk(buddy_default_pool(), ptrs, n);
+}
+
+void *alloc_contig_pages(long npages) {
+    return buddy_pool_alloc_contig(buddy_default_pool(), npages);
+}
+
+int free_contig_pages(void *p, long npages) {
+    return buddy_pool_free_contig(buddy_default_pool(), p, npages);
+}
+
+int query_stats(struct buddy_stats *stats) {
+    return buddy_pool_stats(buddy_default_pool(), stats);
+}
+
+int dump_stats(FILE *out) {
+    return buddy_pool_dump(buddy_default_pool(), out);
 }
@@ -2,7 +2,12 @@
 #define OS_MM_H
 #define MAX_ERRNO 4095
 
+#include <stdint.h>
+#include <stdio.h>
+
 #define OK          0
+#define ENOMEM      12  /* Out of memory */
+#define EBUSY       16  /* Pages in use */
 #define EINVAL      22  /* Invalid argument */    
 #define ENOSPC      28  /* No page left */  
 
@@ -19,4 +24,164 @@ int return_pages(void *p);
 int query_ranks(void *p);
 int query_page_counts(int rank);
 
+/* per-thread rank 1 page caches, disabled while high is 0 */
+int pcp_config(int high, int low, int batch);
+void pcp_drain(void);
+
+/*
+ * a lock-free stack of rank 1 pages shared by all threads, refilled and drained
+ * batch pages at a time around high, disabled while high is 0; setting it
+ * empties it
+ */
+int lockfree_config(int high, int batch);
+
+/* defer merging freed blocks until limit frees are owed, 0 merges at once */
+int lazy_config(int limit);
+
+/* hand out the lowest free block of the ranks whose bit is set, 0 for LIFO */
+int addr_order_config(unsigned long ranks);
+
+/*
+ * Grouping by mobility: the region is divided into pageblocks of
+ * pageblock_rank, each holding unmovable or movable allocations as far as
+ * possible, so that long-lived unmovable pages do not end up scattered over
+ * the whole region. 0 turns grouping off. alloc_pages() allocates unmovable
+ * pages, as do the bulk and contiguous allocations below.
+ */
+#define PAGE_UNMOVABLE 0
+#define PAGE_MOVABLE 1
+
+int mobility_config(int pageblock_rank);
+void *alloc_pages_type(int rank, int type);
+
+/*
+ * Compaction: used blocks are moved out of the way to make up a free block of
+ * a rank. migrate() must copy a block of rank from `from` to `to` and have its
+ * owner use `to` from then on, returning OK, or refuse with an error. Only
+ * blocks in movable pageblocks are moved while grouping is on. With automatic
+ * set, a failing request of rank 2 or above compacts and tries again.
+ * compact_pages() returns how many blocks were moved, or -ENOSPC if no free
+ * block of the rank could be made up.
+ */
+int compact_config(int (*migrate)(void *from, void *to, int rank, void *arg),
+                   void *arg, int automatic);
+int compact_pages(int rank);
+
+/*
+ * Watermarks on the free pages of a pool. Once an allocation leaves fewer than
+ * low pages free, the reclaim callbacks are asked in turn to free pages until
+ * high are free or none frees any more; a callback returns how many pages it
+ * freed. They are called from a background thread if background is set, and
+ * otherwise by the allocating thread, which also calls them itself before an
+ * allocation that would leave fewer than min pages free. low 0 turns them off.
+ */
+int watermark_config(long min, long low, long high, int background);
+int register_reclaim(long (*fn)(long pages, void *arg), void *arg);
+int unregister_reclaim(long (*fn)(long pages, void *arg), void *arg);
+
+/*
+ * Zeroed pages. alloc_pages_zeroed() hands out a block cleared to zero, taking
+ * one of the free blocks known to be zeroed if there is any. A background
+ * thread keeps at least target free pages zeroed, 0 stops it; plain
+ * allocations leave zeroed blocks alone as long as there are others.
+ */
+void *alloc_pages_zeroed(int rank);
+int prezero_config(long target);
+
+/*
+ * Memory hot-add and hot-remove. A region of pgcount pages at p, at or above
+ * the first region of the pool, is added to it, or taken out of it again once
+ * all its pages are free; used blocks are moved out of the way by the
+ * compaction callback if there is one, and -EBUSY is returned if some remain.
+ * The metadata grows along while the pool spans no more pages than it was laid
+ * out for, which buddy_pool_reserve() sets ahead; growing beyond moves it, and
+ * no other call on the pool may run meanwhile.
+ */
+int buddy_add_region(void *p, long pgcount);
+int buddy_remove_region(void *p, long pgcount);
+
+/* up to n blocks of rank at once, return how many were allocated or freed */
+int alloc_pages_bulk(int rank, int n, void **out);
+int return_pages_bulk(void **ptrs, int n);
+
+/* exactly npages contiguous pages, the rest of the block they come from is freed */
+void *alloc_contig_pages(long npages);
+int free_contig_pages(void *p, long npages);
+
+#define BUDDY_MAX_RANK 40
+
+/*
+ * Health of a pool, entries 1 to rank_num of the arrays are filled in. The
+ * indices are in thousandths, for a request of each rank:
+ *   unusable_index - share of the free pages in blocks too small for it
+ *   frag_index     - towards 0 it fails for want of free pages, towards 1000
+ *                    for want of a large enough block; -1000 if it would succeed
+ */
+struct buddy_stats {
+    int rank_num;
+    uint64_t total_pages, free_pages;
+    int largest_free;           /* rank of the largest free block, 0 if none */
+    uint64_t free_blocks[BUDDY_MAX_RANK + 1];
+    uint64_t rank_free_pages[BUDDY_MAX_RANK + 1];
+    int unusable_index[BUDDY_MAX_RANK + 1];
+    int frag_index[BUDDY_MAX_RANK + 1];
+    uint64_t splits, merges;
+    uint64_t steals;            /* blocks taken from the lists of another type */
+    uint64_t migrations;        /* blocks moved by compaction */
+    uint64_t reclaims;          /* runs of the reclaim callbacks */
+    uint64_t reclaimed;         /* pages they reported freed */
+    uint64_t zero_pages;        /* free pages known to be zeroed */
+    uint64_t prezeroed;         /* pages zeroed in the background */
+    uint64_t zero_fills;        /* pages zeroed on allocation for want of any */
+    uint64_t alloc_fails[BUDDY_MAX_RANK + 1];
+};
+
+int query_stats(struct buddy_stats *stats);
+int dump_stats(FILE *out);
+
+/* 
+ * Independent pools, each managing its own region. A pool may list other
+ * pools to fall back on, in order, when it cannot satisfy an allocation;
+ * blocks can then be freed or queried through the pool they were requested
+ * from. The functions above operate on the default pool.
+ */
+typedef struct buddy_pool buddy_pool_t;
+
+buddy_pool_t *buddy_pool_create(void *p, long pgcount);
+void buddy_pool_destroy(buddy_pool_t *pool);
+buddy_pool_t *buddy_default_pool(void);
+int buddy_pool_set_fallback(buddy_pool_t *pool, buddy_pool_t **zonelist, int n);
+void *buddy_pool_alloc(buddy_pool_t *pool, int rank);
+void *buddy_pool_alloc_type(buddy_pool_t *pool, int rank, int type);
+void *buddy_pool_alloc_zeroed(buddy_pool_t *pool, int rank);
+int buddy_pool_free(buddy_pool_t *pool, void *p);
+int buddy_pool_alloc_bulk(buddy_pool_t *pool, int rank, int n, void **out);
+int buddy_pool_free_bulk(buddy_pool_t *pool, void **ptrs, int n);
+void *buddy_pool_alloc_contig(buddy_pool_t *pool, long npages);
+int buddy_pool_free_contig(buddy_pool_t *pool, void *p, long npages);
+int buddy_pool_query_ranks(buddy_pool_t *pool, void *p);
+int buddy_pool_query_page_counts(buddy_pool_t *pool, int rank);
+int buddy_pool_pcp_config(buddy_pool_t *pool, int high, int low, int batch);
+void buddy_pool_pcp_drain(buddy_pool_t *pool);
+int buddy_pool_lockfree(buddy_pool_t *pool, int high, int batch);
+int buddy_pool_lazy_config(buddy_pool_t *pool, int limit);
+int buddy_pool_addr_order(buddy_pool_t *pool, unsigned long ranks);
+int buddy_pool_mobility(buddy_pool_t *pool, int pageblock_rank);
+int buddy_pool_compact_config(buddy_pool_t *pool,
+                              int (*migrate)(void *from, void *to, int rank, void *arg),
+                              void *arg, int automatic);
+int buddy_pool_compact(buddy_pool_t *pool, int rank);
+int buddy_pool_prezero(buddy_pool_t *pool, long target);
+int buddy_pool_add_region(buddy_pool_t *pool, void *p, long pgcount);
+int buddy_pool_remove_region(buddy_pool_t *pool, void *p, long pgcount);
+int buddy_pool_reserve(buddy_pool_t *pool, long pages);
+int buddy_pool_watermarks(buddy_pool_t *pool, long min, long low, long high,
+                          int background);
+int buddy_pool_register_reclaim(buddy_pool_t *pool, long (*fn)(long pages, void *arg),
+                                void *arg);
+int buddy_pool_unregister_reclaim(buddy_pool_t *pool, long (*fn)(long pages, void *arg),
+                                  void *arg);
+int buddy_pool_stats(buddy_pool_t *pool, struct buddy_stats *stats);
+int buddy_pool_dump(buddy_pool_t *pool, FILE *out);
+
 #endif
\ No newline at end of file
@@ -1,8 +1,11 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "buddy.h"
+#include "slab.h"
 #include "utils.h"
 int fake_mode = 0;
 int cont = 0;
@@ -17,6 +20,47 @@ int pow2f(int n) {
     return 2 * pow2f(n - 1);
 }
 
+static void ctor(void *obj) {
+    *(int *)obj = 0x5a5a;
+}
+
+// a cache of pages given back under memory pressure, one at a time
+static void *held[64];
+static int held_num;
+
+static long shrink(long pages, void *arg) {
+    (void)arg;
+    long freed = 0;
+    while (freed < pages && held_num > 0) {
+        if (return_pages(held[--held_num]) == OK) freed++;
+    }
+    return freed;
+}
+
+// move a page of `arg`, a table of 64 pages, refusing those not in it
+static int migrate(void *from, void *to, int rank, void *arg) {
+    void **pages = arg;
+    for (int i = 0; i < 64; ++i) {
+        if (pages[i] != from) continue;
+        memcpy(to, from, (size_t)4096 << (rank - 1));
+        pages[i] = to;
+        return OK;
+    }
+    return -EINVAL;
+}
+
+// take all the pages there are in blocks of ranks 1 to 3 and give them back
+static void *churn(void *arg) {
+    (void)arg;
+    void *got[64];
+    for (int round = 0; round < 2000; ++round) {
+        int n = 0;
+        while (n < 64 && !IS_ERR(got[n] = alloc_pages(1 + (round + n) % 3))) n++;
+        while (n > 0) return_pages(got[--n]);
+    }
+    return NULL;
+}
+
 int main() {
     void *p, *q;
     int ret, pgIdx, freeCnt, currentRank;
@@ -52,8 +96,8 @@ int main() {
         printf("Phase 4: return pages\n");
         tCnt = 0;
         q = p;
-        ok(PTR_ERR(return_pages(NULL)) == -EINVAL);
-        ok(PTR_ERR(return_pages(p + TESTSIZE * 1024 * 1024 + 16)) == -EINVAL);
+        ok(return_pages(NULL) == -EINVAL);
+        ok(return_pages(p + TESTSIZE * 1024 * 1024 + 16) == -EINVAL);
         for (pgIdx = 0; pgIdx < MAXRANK0PAGE; pgIdx++, q = q + 1024 * 4) {
             ret = return_pages(q);
             dotOk(ret == OK);
@@ -91,7 +135,7 @@ int main() {
         printf("Phase 8A: mixed 1\n");
         tCnt = 0;
         for (pgIdx = 0; pgIdx < MAXRANK0PAGE; pgIdx++, q = q + 1024 * 4) {
-            void *r = alloc_pages(1);
+            alloc_pages(1);
         }
         dotOk(query_page_counts(MAXRANK) == 0);
         q = p;
@@ -116,7 +160,7 @@ int main() {
         tCnt = 0;
         q = p;
         for (pgIdx = 0; pgIdx < MAXRANK0PAGE; pgIdx++, q = q + 1024 * 4) {
-            void *r = alloc_pages(1);
+            alloc_pages(1);
         }
         q = p;
         freeCnt = 0;
@@ -137,6 +181,500 @@ int main() {
 // for (int i = 1; i <= MAXRANK; ++i) printf("[dbg] page %d\n", query_page_counts(i));
         dotDone();
     }
+    {
+        printf("Phase 9: pools with fallback\n");
+        tCnt = 0;
+        buddy_pool_t *near = buddy_pool_create(p, 4);
+        buddy_pool_t *far = buddy_pool_create(p + 1024 * 4 * 4, 8);
+        dotOk(!IS_ERR(near) && !IS_ERR(far));
+        dotOk(buddy_pool_set_fallback(near, &far, 1) == OK);
+        dotOk(buddy_pool_alloc(near, 3) == p);
+        dotOk(buddy_pool_alloc(near, 3) == p + 1024 * 4 * 4);
+        dotOk(buddy_pool_query_page_counts(far, 3) == 1);
+        dotOk(PTR_ERR(buddy_pool_alloc(near, 4)) == -ENOSPC);
+        dotOk(PTR_ERR(buddy_pool_alloc(far, 5)) == -EINVAL);
+        dotOk(buddy_pool_query_ranks(near, p + 1024 * 4 * 4) == 3);
+        dotOk(buddy_pool_free(near, p + 1024 * 4 * 4) == OK);
+        dotOk(buddy_pool_query_page_counts(far, 4) == 1);
+        dotOk(buddy_pool_free(far, p) == -EINVAL);
+        dotOk(buddy_pool_free(near, p) == OK);
+        dotOk(buddy_pool_query_page_counts(near, 3) == 1);
+        buddy_pool_destroy(near);
+        buddy_pool_destroy(far);
+        dotDone();
+    }
+    {
+        printf("Phase 10: non-power-of-two page count\n");
+        tCnt = 0;
+        /* 3000 = 2048 + 512 + 256 + 128 + 32 + 16 + 8 */
+        int tail[] = {12, 10, 9, 8, 6, 5, 4};
+        ret = init_page(p, 3000);
+        dotOk(ret == OK);
+        for (pgIdx = 0; pgIdx < 7; ++pgIdx)
+            dotOk(query_page_counts(tail[pgIdx]) == 1);
+        q = p;
+        for (pgIdx = 0; pgIdx < 3000; pgIdx++, q = q + 1024 * 4)
+            dotOk(alloc_pages(1) != NULL);
+        dotOk(PTR_ERR(alloc_pages(1)) == -ENOSPC);
+        dotOk(return_pages(p + 1024 * 4 * 3000) == -EINVAL);
+        q = p;
+        for (pgIdx = 0; pgIdx < 3000; pgIdx++, q = q + 1024 * 4)
+            dotOk(return_pages(q) == OK);
+        for (pgIdx = 0; pgIdx < 7; ++pgIdx)
+            dotOk(query_page_counts(tail[pgIdx]) == 1);
+        dotOk(query_ranks(p + 1024 * 4 * 2944) == 6);
+        dotDone();
+    }
+    {
+        printf("Phase 11: bulk alloc and return\n");
+        tCnt = 0;
+        int tail[] = {12, 10, 9, 8, 6, 5, 4};
+        void **pages = malloc(3001 * sizeof(void *));
+        ret = init_page(p, 3000);
+        dotOk(alloc_pages_bulk(2, 1000, pages) == 1000);
+        dotOk(alloc_pages_bulk(1, 1001, pages + 1000) == 1000);
+        dotOk(PTR_ERR(alloc_pages(1)) == -ENOSPC);
+        for (pgIdx = 0; pgIdx < 1000; ++pgIdx)
+            dotOk(query_ranks(pages[pgIdx]) == 2);
+        pages[2000] = pages[0];
+        dotOk(return_pages_bulk(pages, 2001) == 2000);
+        dotOk(return_pages_bulk(pages, 2000) == 0);
+        for (pgIdx = 0; pgIdx < 7; ++pgIdx)
+            dotOk(query_page_counts(tail[pgIdx]) == 1);
+        free(pages);
+        dotDone();
+    }
+    {
+        printf("Phase 12: lazy merging\n");
+        tCnt = 0;
+        void *pages[16];
+        ret = init_page(p, 16);
+        dotOk(lazy_config(100) == OK);
+        for (pgIdx = 0; pgIdx < 16; ++pgIdx) pages[pgIdx] = alloc_pages(1);
+        for (pgIdx = 0; pgIdx < 16; ++pgIdx) dotOk(return_pages(pages[pgIdx]) == OK);
+        dotOk(query_page_counts(1) == 16);
+        dotOk(query_page_counts(5) == 0);
+        dotOk(alloc_pages(5) == p);
+        dotOk(query_page_counts(1) == 0);
+        dotOk(return_pages(p) == OK);
+        dotOk(lazy_config(4) == OK);
+        for (pgIdx = 0; pgIdx < 4; ++pgIdx) pages[pgIdx] = alloc_pages(1);
+        for (pgIdx = 0; pgIdx < 3; ++pgIdx) dotOk(return_pages(pages[pgIdx]) == OK);
+        dotOk(query_page_counts(5) == 0);
+        dotOk(return_pages(pages[3]) == OK);
+        dotOk(query_page_counts(5) == 1);
+        dotOk(lazy_config(0) == OK);
+        dotDone();
+    }
+    {
+        printf("Phase 13: slab caches\n");
+        tCnt = 0;
+        struct kmem_cache_stats st;
+        void *objs[200];
+        ret = init_page(p, 64);
+        dotOk(IS_ERR(kmem_cache_create("bad", 0, 8, NULL)));
+        dotOk(IS_ERR(kmem_cache_create("bad", 64, 24, NULL)));
+        kmem_cache_t *cache = kmem_cache_create("test", 100, 64, ctor);
+        dotOk(!IS_ERR(cache));
+        kmem_cache_stats(cache, &st);
+        dotOk(st.obj_size == 128 && st.slab_rank == 1 && st.objs_per_slab >= 8);
+        for (pgIdx = 0; pgIdx < 200; ++pgIdx) {
+            objs[pgIdx] = kmem_cache_alloc(cache);
+            dotOk(!IS_ERR(objs[pgIdx]) && (unsigned long)objs[pgIdx] % 64 == 0);
+            dotOk(*(int *)objs[pgIdx] == 0x5a5a);
+        }
+        kmem_cache_stats(cache, &st);
+        dotOk(st.objs_active == 200 && st.slab_allocs == (200 + st.objs_per_slab - 1) / st.objs_per_slab);
+        dotOk(query_page_counts(7) == 0);
+        dotOk(kmem_cache_free(cache, (char *)objs[0] + 8) == -EINVAL);
+        // freed twice while the rest of its slab is in use, it is given out once
+        q = objs[1];
+        dotOk(kmem_cache_free(cache, q) == OK);
+        dotOk(kmem_cache_free(cache, q) == -EINVAL);
+        kmem_cache_stats(cache, &st);
+        dotOk(st.objs_active == 199);
+        dotOk((objs[1] = kmem_cache_alloc(cache)) == q);
+        void *o = kmem_cache_alloc(cache);
+        dotOk(o != q && kmem_cache_free(cache, o) == OK);
+        for (pgIdx = 0; pgIdx < 200; ++pgIdx)
+            dotOk(kmem_cache_free(cache, objs[pgIdx]) == OK);
+        dotOk(kmem_cache_free(cache, objs[0]) == -EINVAL);
+        kmem_cache_stats(cache, &st);
+        dotOk(st.objs_active == 0 && st.slabs_full == 0 && st.slabs_partial == 0);
+        dotOk(st.slabs_empty == 1 && st.slab_frees == st.slab_allocs - 1);
+        dotOk(kmem_cache_shrink(cache) == 1);
+        dotOk(query_page_counts(7) == 1);
+        kmem_cache_destroy(cache);
+        dotDone();
+    }
+    {
+        printf("Phase 14: address-ordered free lists\n");
+        tCnt = 0;
+        void *pages[8];
+        ret = init_page(p, 64);
+        dotOk(addr_order_config(~0UL) == OK);
+        for (pgIdx = 0; pgIdx < 8; ++pgIdx) {
+            pages[pgIdx] = alloc_pages(1);
+            dotOk(pages[pgIdx] == p + 1024 * 4 * pgIdx);
+        }
+        dotOk(return_pages(pages[1]) == OK);
+        dotOk(return_pages(pages[5]) == OK);
+        dotOk(return_pages(pages[3]) == OK);
+        dotOk(alloc_pages(1) == pages[1]);
+        dotOk(alloc_pages(1) == pages[3]);
+        dotOk(alloc_pages(1) == pages[5]);
+        dotOk(alloc_pages(1) == p + 1024 * 4 * 8);
+        dotOk(addr_order_config(0) == OK);
+        dotDone();
+    }
+    {
+        printf("Phase 15: contiguous runs\n");
+        tCnt = 0;
+        ret = init_page(p, 64);
+        dotOk(alloc_contig_pages(5) == p);
+        dotOk(query_ranks(p) == 3);
+        for (pgIdx = 1; pgIdx <= 6; ++pgIdx)
+            dotOk(query_page_counts(pgIdx) == (pgIdx != 3));
+        dotOk(alloc_pages(1) == p + 1024 * 4 * 5);
+        dotOk(return_pages(p + 1024 * 4 * 5) == OK);
+        dotOk(free_contig_pages(p, 6) == -EINVAL);
+        dotOk(free_contig_pages(p, 5) == OK);
+        dotOk(query_page_counts(7) == 1);
+        dotOk(free_contig_pages(p, 5) == -EINVAL);
+        dotOk(alloc_contig_pages(0) == (void *)-EINVAL);
+        dotOk(alloc_contig_pages(65) == (void *)-EINVAL);
+        dotOk(alloc_contig_pages(64) == p);
+        dotOk(alloc_contig_pages(1) == (void *)-ENOSPC);
+        dotOk(free_contig_pages(p, 64) == OK);
+        dotDone();
+    }
+    {
+        printf("Phase 16: statistics\n");
+        tCnt = 0;
+        struct buddy_stats st;
+        void *pages[4];
+        ret = init_page(p, 64);
+        dotOk(query_stats(&st) == OK);
+        dotOk(st.rank_num == 7 && st.total_pages == 64 && st.free_pages == 64);
+        dotOk(st.largest_free == 7 && st.splits == 0 && st.merges == 0);
+        dotOk(st.frag_index[7] == -1000 && st.unusable_index[7] == 0);
+        for (pgIdx = 0; pgIdx < 4; ++pgIdx) pages[pgIdx] = alloc_pages(1);
+        dotOk(return_pages(pages[1]) == OK);
+        dotOk(return_pages(pages[3]) == OK);
+        dotOk(alloc_pages(7) == (void *)-ENOSPC);
+        query_stats(&st);
+        dotOk(st.free_pages == 62 && st.free_blocks[1] == 2 && st.rank_free_pages[6] == 32);
+        dotOk(st.largest_free == 6 && st.splits == 7 && st.merges == 0);
+        dotOk(st.alloc_fails[7] == 1 && st.alloc_fails[1] == 0);
+        // 62 free pages in 6 blocks for a request of 64: 1000 - (1000 + 968) / 6
+        dotOk(st.frag_index[7] == 672 && st.frag_index[6] == -1000);
+        dotOk(st.unusable_index[2] == 2 * 1000 / 62);
+        dotOk(return_pages(pages[0]) == OK);
+        dotOk(return_pages(pages[2]) == OK);
+        query_stats(&st);
+        dotOk(st.largest_free == 7 && st.merges == 7);
+        dotDone();
+    }
+    {
+        printf("Phase 17: mobility grouping\n");
+        tCnt = 0;
+        struct buddy_stats st;
+        ret = init_page(p, 64);
+        dotOk(mobility_config(-1) == -EINVAL);
+        dotOk(mobility_config(3) == OK);
+        dotOk(alloc_pages_type(1, 2) == (void *)-EINVAL);
+        // the first unmovable page claims the first pageblock of 4 pages
+        void *u = alloc_pages(1);
+        dotOk(u == p);
+        void *m = alloc_pages_type(1, PAGE_MOVABLE);
+        dotOk(m == p + 1024 * 4 * 4);
+        void *u2 = alloc_pages(1);
+        dotOk(u2 == p + 1024 * 4 * 1);
+        query_stats(&st);
+        dotOk(st.steals == 1);
+        dotOk(return_pages(u) == OK);
+        dotOk(return_pages(m) == OK);
+        dotOk(return_pages(u2) == OK);
+        dotOk(query_page_counts(7) == 1);
+        dotOk(mobility_config(0) == OK);
+        dotOk(alloc_pages_type(1, PAGE_MOVABLE) == p);
+        dotDone();
+    }
+    {
+        printf("Phase 18: compaction\n");
+        tCnt = 0;
+        void *pages[64];
+        struct buddy_stats st;
+        ret = init_page(p, 64);
+        dotOk(compact_pages(2) == -EINVAL);
+        dotOk(compact_config(NULL, NULL, 1) == -EINVAL);
+        for (pgIdx = 0; pgIdx < 64; ++pgIdx) {
+            pages[pgIdx] = alloc_pages(1);
+            *(int *)pages[pgIdx] = pgIdx;
+        }
+        for (pgIdx = 0; pgIdx < 64; pgIdx += 2) {
+            dotOk(return_pages(pages[pgIdx]) == OK);
+            pages[pgIdx] = NULL;
+        }
+        dotOk(compact_config(migrate, pages, 0) == OK);
+        dotOk(alloc_pages(2) == (void *)-ENOSPC);
+        dotOk(compact_pages(2) == 1);
+        q = alloc_pages(2);
+        dotOk(!IS_ERR(q));
+        dotOk(return_pages(q) == OK);
+        // the rank 2 block is still free, nothing to move
+        dotOk(compact_pages(2) == 0);
+        dotOk(compact_config(migrate, pages, 1) == OK);
+        q = alloc_pages(5);
+        dotOk(!IS_ERR(q));
+        dotOk(alloc_pages(6) == (void *)-ENOSPC);
+        for (pgIdx = 1; pgIdx < 64; pgIdx += 2) {
+            dotOk(*(int *)pages[pgIdx] == pgIdx);
+            dotOk(pages[pgIdx] < q || pages[pgIdx] >= q + 1024 * 4 * 16);
+        }
+        query_stats(&st);
+        dotOk(st.migrations == 1 + 7);
+        dotOk(return_pages(q) == OK);
+        for (pgIdx = 1; pgIdx < 64; pgIdx += 2) dotOk(return_pages(pages[pgIdx]) == OK);
+        dotOk(query_page_counts(7) == 1);
+        dotOk(compact_config(NULL, NULL, 0) == OK);
+        dotDone();
+    }
+    {
+        printf("Phase 19: watermarks\n");
+        tCnt = 0;
+        struct buddy_stats st;
+        ret = init_page(p, 64);
+        dotOk(watermark_config(8, 4, 16, 0) == -EINVAL);
+        dotOk(watermark_config(-1, 4, 16, 0) == -EINVAL);
+        dotOk(register_reclaim(NULL, NULL) == -EINVAL);
+        dotOk(unregister_reclaim(shrink, NULL) == -EINVAL);
+        dotOk(register_reclaim(shrink, NULL) == OK);
+        dotOk(watermark_config(4, 8, 16, 0) == OK);
+        for (held_num = 0; held_num < 48; ++held_num) held[held_num] = alloc_pages(1);
+        // 16 free, at the high watermark
+        query_stats(&st);
+        dotOk(st.free_pages == 16 && st.reclaims == 0);
+        q = alloc_pages(4);
+        // 8 left is not below low yet
+        query_stats(&st);
+        dotOk(st.reclaims == 0);
+        void *r = alloc_pages(1);
+        // 7 left, the cache gives back 9 pages
+        query_stats(&st);
+        dotOk(st.reclaims == 1 && st.reclaimed == 9);
+        dotOk(st.free_pages == 16 && held_num == 39);
+        dotOk(return_pages(r) == OK);
+        dotOk(return_pages(q) == OK);
+
+        dotOk(watermark_config(4, 12, 24, 1) == OK);
+        q = alloc_pages(4);
+        r = alloc_pages(4);
+        // 9 left is still above min, so the background thread reclaims 15
+        for (pgIdx = 0; pgIdx < 1000 && held_num > 24; ++pgIdx) usleep(1000);
+        dotOk(held_num == 24);
+        query_stats(&st);
+        dotOk(st.free_pages == 24 && st.reclaims == 2);
+        dotOk(watermark_config(0, 0, 0, 0) == OK);
+        dotOk(unregister_reclaim(shrink, NULL) == OK);
+        dotOk(return_pages(q) == OK);
+        dotOk(return_pages(r) == OK);
+        while (held_num > 0) dotOk(return_pages(held[--held_num]) == OK);
+        dotOk(query_page_counts(7) == 1);
+        dotDone();
+    }
+    {
+        printf("Phase 20: zeroed pages\n");
+        tCnt = 0;
+        struct buddy_stats st;
+        memset(p, 0xab, 64 * 1024 * 4);
+        ret = init_page(p, 64);
+        q = alloc_pages_zeroed(3);
+        for (pgIdx = 0; pgIdx < 4 * 1024 * 4 && ((char *)q)[pgIdx] == 0; ++pgIdx) ;
+        dotOk(pgIdx == 4 * 1024 * 4);
+        query_stats(&st);
+        dotOk(st.zero_fills == 4 && st.zero_pages == 0);
+        // freed by its user, it is no longer known to be zeroed
+        dotOk(return_pages(q) == OK);
+        query_stats(&st);
+        dotOk(st.zero_pages == 0);
+
+        dotOk(prezero_config(-1) == -EINVAL);
+        void *a = alloc_pages(6);
+        dotOk(prezero_config(32) == OK);
+        for (pgIdx = 0; pgIdx < 1000 && st.zero_pages < 32; ++pgIdx) {
+            usleep(1000);
+            query_stats(&st);
+        }
+        dotOk(prezero_config(0) == OK);
+        query_stats(&st);
+        dotOk(st.zero_pages == 32 && st.prezeroed == 32);
+        // merged with a block of unknown contents, the zeroed half is lost
+        dotOk(return_pages(a) == OK);
+        query_stats(&st);
+        dotOk(st.zero_pages == 0 && query_page_counts(7) == 1);
+
+        dotOk(prezero_config(64) == OK);
+        for (pgIdx = 0; pgIdx < 1000 && st.zero_pages < 64; ++pgIdx) {
+            usleep(1000);
+            query_stats(&st);
+        }
+        dotOk(prezero_config(0) == OK);
+        dotOk(st.zero_pages == 64);
+        q = alloc_pages_zeroed(5);
+        void *r = alloc_pages(5);
+        memset(r, 0xcd, 16 * 1024 * 4);
+        dotOk(return_pages(r) == OK);
+        query_stats(&st);
+        dotOk(st.zero_pages == 32 && st.zero_fills == 4);
+        // plain allocations take the block of unknown contents, zeroed ones the rest
+        dotOk(alloc_pages(5) == r);
+        void *z = alloc_pages_zeroed(5);
+        for (pgIdx = 0; pgIdx < 16 * 1024 * 4 && ((char *)z)[pgIdx] == 0; ++pgIdx) ;
+        dotOk(pgIdx == 16 * 1024 * 4);
+        query_stats(&st);
+        dotOk(st.zero_pages == 16 && st.zero_fills == 4);
+        dotOk(return_pages(q) == OK);
+        dotOk(return_pages(r) == OK);
+        dotOk(return_pages(z) == OK);
+        query_stats(&st);
+        dotOk(st.zero_pages == 0 && query_page_counts(7) == 1);
+        dotDone();
+    }
+    {
+        printf("Phase 21: adding and removing regions\n");
+        tCnt = 0;
+        struct buddy_stats st;
+        char *base = p;
+        // beyond the span its metadata was laid out for
+        buddy_pool_t *zone = buddy_pool_create(p, 16);
+        dotOk(buddy_pool_add_region(zone, base + 16 * 4096, 48) == OK);
+        dotOk(buddy_pool_query_page_counts(zone, 7) == 1);
+        dotOk(buddy_pool_reserve(zone, 1024) == OK);
+        dotOk(buddy_pool_add_region(zone, base + 512 * 4096, 512) == OK);
+        dotOk(buddy_pool_query_page_counts(zone, 10) == 1);
+        buddy_pool_destroy(zone);
+
+        ret = init_page(p, 64);
+        // right after the region, merging with it
+        dotOk(buddy_add_region(base + 64 * 4096, 64) == OK);
+        dotOk(query_page_counts(8) == 1);
+        // past a gap of 64 pages, which is left a hole
+        dotOk(buddy_add_region(base + 192 * 4096, 64) == OK);
+        query_stats(&st);
+        dotOk(st.total_pages == 192 && st.free_pages == 192 && query_page_counts(7) == 1);
+        dotOk(buddy_add_region(base + 160 * 4096, 64) == -EINVAL);
+        dotOk(buddy_add_region(base + 1, 4) == -EINVAL);
+        dotOk(return_pages(base + 128 * 4096) == -EINVAL);
+        dotOk(buddy_add_region(base + 128 * 4096, 64) == OK);
+        dotOk(query_page_counts(9) == 1);
+
+        // taken out once its pages are free
+        void *a = alloc_pages(8);
+        dotOk(a == base);
+        dotOk(buddy_remove_region(base, 64) == -EBUSY);
+        dotOk(return_pages(a) == OK);
+        dotOk(buddy_remove_region(base, 64) == OK);
+        dotOk(buddy_remove_region(base, 64) == -EINVAL);
+        query_stats(&st);
+        dotOk(st.total_pages == 192 && st.free_pages == 192);
+        dotOk(query_page_counts(7) == 1 && query_page_counts(8) == 1);
+
+        // or after its used blocks were moved out
+        void *tab[64] = {NULL};
+        tab[0] = alloc_pages(7);
+        dotOk(tab[0] == base + 64 * 4096);
+        *(int *)tab[0] = 21;
+        dotOk(buddy_remove_region(base + 64 * 4096, 64) == -EBUSY);
+        compact_config(migrate, tab, 0);
+        dotOk(buddy_remove_region(base + 64 * 4096, 64) == OK);
+        compact_config(NULL, NULL, 0);
+        dotOk(tab[0] == base + 128 * 4096 && *(int *)tab[0] == 21);
+        query_stats(&st);
+        dotOk(st.total_pages == 128 && st.free_pages == 64 && st.migrations == 1);
+        dotOk(return_pages(tab[0]) == OK);
+        dotOk(buddy_add_region(base, 128) == OK);
+        query_stats(&st);
+        dotOk(st.total_pages == 256 && st.free_pages == 256 && query_page_counts(9) == 1);
+        dotDone();
+    }
+    {
+        printf("Phase 22: lock-free page stack\n");
+        tCnt = 0;
+        struct buddy_stats st;
+        void *pages[12];
+        ret = init_page(p, 64);
+        dotOk(lockfree_config(4, 8) == -EINVAL);
+        dotOk(lockfree_config(8, 4) == OK);
+        // a batch is taken at once, the pages left over are stacked
+        q = alloc_pages(1);
+        query_stats(&st);
+        dotOk(st.free_pages == 60);
+        void *r = alloc_pages(1);
+        dotOk(return_pages(q) == OK && return_pages(r) == OK);
+        dotOk(return_pages(r) == -EINVAL);
+        query_stats(&st);
+        dotOk(st.free_pages == 60 && alloc_pages(1) == r);
+        dotOk(return_pages(r) == OK);
+
+        // once more than 8 are stacked, 4 go back to the buddy
+        for (int i = 0; i < 12; ++i) pages[i] = alloc_pages(1);
+        query_stats(&st);
+        dotOk(st.free_pages == 52);
+        for (int i = 0; i < 12; ++i) dotOk(return_pages(pages[i]) == OK);
+        query_stats(&st);
+        dotOk(st.free_pages == 57);
+        // a larger request takes the stacked pages back rather than fail
+        q = alloc_pages(7);
+        dotOk(q == p);
+        dotOk(return_pages(q) == OK);
+        dotOk(lockfree_config(0, 0) == OK);
+        dotOk(query_page_counts(7) == 1);
+
+        // an interior page of a used block is refused, not stacked, though
+        // it headed a block of rank 1 before the pool was seeded
+        ret = init_page(p, 64);
+        q = alloc_pages(1);
+        dotOk(alloc_pages(1) == p + 4096);
+        ret = init_page(p, 64);
+        dotOk(lockfree_config(8, 4) == OK);
+        q = alloc_pages(2);
+        dotOk(return_pages(p + 4096) == -EINVAL);
+        for (int i = 0; i < 8; ++i) dotOk(alloc_pages(1) != p + 4096);
+        dotOk(lockfree_config(0, 0) == OK);
+        dotDone();
+    }
+    {
+        printf("Phase 23: per-thread page cache\n");
+        tCnt = 0;
+        // page 1 heads a block of rank 1 in the first round
+        ret = init_page(p, 64);
+        q = alloc_pages(1);
+        dotOk(alloc_pages(1) == p + 4096);
+        ret = init_page(p, 64);
+        dotOk(pcp_config(16, 4, 4) == OK);
+        q = alloc_pages(2);
+        dotOk(q == p);
+        // an interior page of a used block is refused, not cached
+        dotOk(return_pages(p + 4096) == -EINVAL);
+        for (int i = 0; i < 8; ++i) dotOk(alloc_pages(1) != p + 4096);
+        pcp_drain();
+        dotOk(pcp_config(0, 0, 0) == OK);
+        dotDone();
+    }
+    {
+        printf("Phase 24: zeroing under memory pressure\n");
+        tCnt = 0;
+        // the block taken to be zeroed is often gone by the time it is split
+        ret = init_page(p, 64);
+        dotOk(prezero_config(32) == OK);
+        pthread_t tids[2];
+        for (int i = 0; i < 2; ++i) pthread_create(&tids[i], NULL, churn, NULL);
+        for (int i = 0; i < 2; ++i) pthread_join(tids[i], NULL);
+        dotOk(prezero_config(0) == OK);
+        dotOk(query_page_counts(7) == 1);
+        dotDone();
+    }
     finish();
 
     return 0;
@@ -0,0 +1,105 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "buddy.h"
+
+#define PAGE (1024 * 4)
+#define POOLRANK (16)
+#define POOLPAGE (1 << (POOLRANK - 1))
+#define OPS (1 << 19)
+#define SLOTS (64)
+#define MAXTHREAD (64)
+
+static void *pool;
+static int failed;
+static int lazy;
+static int lf_high, lf_batch;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Each worker keeps up to SLOTS blocks, mostly single pages, and randomly
+ * allocates or frees one of them. A tag written into every block detects 
+ * blocks handed out twice.
+ */
+static void *worker(void *arg) {
+    long tag = (long)arg;
+    unsigned seed = tag;
+    void *slot[SLOTS] = {NULL};
+
+    for (long i = 0; i < OPS; ++i) {
+        int k = rand_r(&seed) % SLOTS;
+        if (slot[k] == NULL) {
+            int rank = rand_r(&seed) % 8 == 0 ? 2 + rand_r(&seed) % 3 : 1;
+            void *r = alloc_pages(rank);
+            if (IS_ERR(r)) continue;
+            *(long *)r = tag;
+            slot[k] = r;
+        } else {
+            if (*(long *)slot[k] != tag || return_pages(slot[k]) != OK)
+                __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+            slot[k] = NULL;
+        }
+    }
+    for (int k = 0; k < SLOTS; ++k)
+        if (slot[k] != NULL) return_pages(slot[k]);
+    pcp_drain();
+    return NULL;
+}
+
+static void run(int nthread) {
+    pthread_t tid[MAXTHREAD];
+    init_page(pool, POOLPAGE);
+    double t = now_ns();
+    for (long i = 0; i < nthread; ++i)
+        pthread_create(&tid[i], NULL, worker, (void *)(i + 1));
+    for (int i = 0; i < nthread; ++i) pthread_join(tid[i], NULL);
+    t = now_ns() - t;
+    // settle merges still owed and empty the page stack before checking that the pool is whole
+    lockfree_config(lf_high, lf_batch);
+    lazy_config(lazy);
+    printf("%4d threads %12.0f ops/s %s\n", nthread,
+           (double)OPS * nthread / t * 1e9,
+           query_page_counts(POOLRANK) == 1 && !failed ? "" : "(CORRUPTED)");
+}
+
+int main(int argc, char *argv[]) {
+    int maxthread = argc > 1 ? atoi(argv[1]) : 8;
+    if (maxthread < 1 || maxthread > MAXTHREAD) maxthread = MAXTHREAD;
+    pool = malloc((size_t)POOLPAGE * PAGE);
+    if (pool == NULL) return 1;
+
+    printf("Buddy multithreaded benchmark (%d pages, %d ops per thread)\n",
+           POOLPAGE, OPS);
+    printf("per-rank locks:\n");
+    for (int n = 1; n <= maxthread; n *= 2) run(n);
+    printf("per-rank locks + per-thread page cache:\n");
+    pcp_config(64, 16, 16);
+    for (int n = 1; n <= maxthread; n *= 2) run(n);
+    pcp_config(0, 0, 0);
+    printf("per-rank locks + lock-free page stack:\n");
+    lf_high = 256;
+    lf_batch = 64;
+    lockfree_config(lf_high, lf_batch);
+    for (int n = 1; n <= maxthread; n *= 2) run(n);
+    printf("lock-free page stack + per-thread page cache:\n");
+    pcp_config(64, 16, 16);
+    for (int n = 1; n <= maxthread; n *= 2) run(n);
+    pcp_config(0, 0, 0);
+    lf_high = lf_batch = 0;
+    lockfree_config(0, 0);
+    printf("per-rank locks + lazy merging:\n");
+    lazy = 256;
+    for (int n = 1; n <= maxthread; n *= 2) run(n);
+    lazy = 0;
+    lazy_config(0);
+    pcp_config(0, 0, 0);
+    free(pool);
+    return failed;
+}
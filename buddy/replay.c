@@ -0,0 +1,368 @@
+/*
+ * replay.c - trace replay benchmark for the buddy page allocator
+ *
+ * Replays a page-level trace, either read from a file or generated, and
+ * reports per-operation latency percentiles measured with the cycle counter,
+ * throughput, and the statistics of the pool left at the end.
+ *
+ * A trace file has three header lines followed by one request per line:
+ *   <pages>      size of the region in pages
+ *   <num_ids>    number of distinct block ids
+ *   <num_ops>    number of requests
+ *   a <id> <rank>
+ *   f <id>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "../clock.h"
+
+#define PAGE (1024 * 4)
+#define HUGE_PAGE (1024 * 1024 * 2)
+
+typedef struct {
+    char type;                  /* 'a' or 'f' */
+    int index;                  /* block id */
+    int rank;                   /* rank of an allocation */
+} traceop_t;
+
+typedef struct {
+    int pages;
+    int num_ids;
+    int num_ops;
+    traceop_t *ops;
+} trace_t;
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: buddy-bench [-f <file> | -g <pattern>] [-n <ops>] [-p <pages>]\n"
+            "                   [-s <seed>] [-w <file>] [-c] [-l <limit>] [-o]\n"
+            "  -f <file>     replay a recorded trace\n"
+            "  -g <pattern>  generate a trace: random, pingpong, burst, fifo or churn\n"
+            "  -n <ops>      requests in a generated trace (default 1000000)\n"
+            "  -p <pages>    region size of a generated trace (default 32768)\n"
+            "  -s <seed>     seed of a generated trace\n"
+            "  -w <file>     record the trace to a file and exit\n"
+            "  -c            enable per-thread page caches\n"
+            "  -l <limit>    defer merges until <limit> frees are owed\n"
+            "  -o            hand out the lowest free block of every rank\n");
+    exit(1);
+}
+
+static trace_t *trace_alloc(int pages, int num_ids, int num_ops) {
+    trace_t *trace = malloc(sizeof(trace_t));
+    if (trace == NULL) return NULL;
+    trace->pages = pages;
+    trace->num_ids = num_ids;
+    trace->num_ops = 0;
+    trace->ops = malloc((size_t)num_ops * sizeof(traceop_t));
+    if (trace->ops == NULL) {
+        free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+static void trace_free(trace_t *trace) {
+    free(trace->ops);
+    free(trace);
+}
+
+static void push_op(trace_t *trace, char type, int index, int rank) {
+    traceop_t *op = &trace->ops[trace->num_ops++];
+    op->type = type;
+    op->index = index;
+    op->rank = rank;
+}
+
+static trace_t *read_trace(const char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        perror(filename);
+        return NULL;
+    }
+    int pages, num_ids, num_ops;
+    if (fscanf(fp, "%d %d %d", &pages, &num_ids, &num_ops) != 3 ||
+        pages < 1 || num_ids < 1 || num_ops < 0) {
+        fprintf(stderr, "%s: bad header\n", filename);
+        fclose(fp);
+        return NULL;
+    }
+    trace_t *trace = trace_alloc(pages, num_ids, num_ops);
+    if (trace == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+
+    char type[2];
+    int index, rank = 0;
+    while (trace->num_ops < num_ops && fscanf(fp, "%1s %d", type, &index) == 2) {
+        if ((type[0] != 'a' && type[0] != 'f') || index < 0 || index >= num_ids ||
+            (type[0] == 'a' && fscanf(fp, "%d", &rank) != 1)) {
+            fprintf(stderr, "%s: bad request %d\n", filename, trace->num_ops);
+            trace_free(trace);
+            fclose(fp);
+            return NULL;
+        }
+        push_op(trace, type[0], index, rank);
+    }
+    fclose(fp);
+    return trace;
+}
+
+static int write_trace(const trace_t *trace, const char *filename) {
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL) {
+        perror(filename);
+        return -1;
+    }
+    fprintf(fp, "%d\n%d\n%d\n", trace->pages, trace->num_ids, trace->num_ops);
+    for (int i = 0; i < trace->num_ops; ++i) {
+        const traceop_t *op = &trace->ops[i];
+        if (op->type == 'a') fprintf(fp, "a %d %d\n", op->index, op->rank);
+        else fprintf(fp, "f %d\n", op->index);
+    }
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * Synthetic traces.
+ *   random   - up to 4096 live blocks, ranks 1-8 with halving odds, freed at random
+ *   pingpong - one page allocated and freed over and over
+ *   burst    - 64 pages allocated and then freed in reverse order
+ *   fifo     - a window of 4096 blocks of ranks 1-4, freed oldest first
+ *   churn    - 4096 blocks of ranks 1-4, then one freed at random per allocation
+ */
+static trace_t *gen_trace(const char *pattern, int pages, int num_ops, unsigned seed) {
+    const int window = 4096;
+    trace_t *trace = trace_alloc(pages, window, num_ops);
+    if (trace == NULL) return NULL;
+
+    if (strcmp(pattern, "random") == 0) {
+        int *live = malloc(window * sizeof(int)), *slot = malloc(window * sizeof(int));
+        int live_num = 0, free_num = window;
+        for (int i = 0; i < window; ++i) slot[i] = window - 1 - i;
+        while (trace->num_ops < num_ops) {
+            if (live_num == 0 || (free_num > 0 && rand_r(&seed) % 2)) {
+                int rank = 1;
+                while (rank < 8 && rand_r(&seed) % 2) rank++;
+                int index = slot[--free_num];
+                live[live_num++] = index;
+                push_op(trace, 'a', index, rank);
+            } else {
+                int k = rand_r(&seed) % live_num;
+                int index = live[k];
+                live[k] = live[--live_num];
+                slot[free_num++] = index;
+                push_op(trace, 'f', index, 0);
+            }
+        }
+        free(live);
+        free(slot);
+    } else if (strcmp(pattern, "pingpong") == 0) {
+        while (trace->num_ops + 2 <= num_ops) {
+            push_op(trace, 'a', 0, 1);
+            push_op(trace, 'f', 0, 0);
+        }
+    } else if (strcmp(pattern, "burst") == 0) {
+        while (trace->num_ops + 128 <= num_ops) {
+            for (int i = 0; i < 64; ++i) push_op(trace, 'a', i, 1);
+            for (int i = 63; i >= 0; --i) push_op(trace, 'f', i, 0);
+        }
+    } else if (strcmp(pattern, "fifo") == 0) {
+        for (int i = 0; trace->num_ops + 2 <= num_ops; ++i) {
+            if (i >= window) push_op(trace, 'f', i % window, 0);
+            push_op(trace, 'a', i % window, 1 + rand_r(&seed) % 4);
+        }
+    } else if (strcmp(pattern, "churn") == 0) {
+        for (int i = 0; i < window && trace->num_ops < num_ops; ++i)
+            push_op(trace, 'a', i, 1 + rand_r(&seed) % 4);
+        while (trace->num_ops + 2 <= num_ops) {
+            int index = rand_r(&seed) % window;
+            push_op(trace, 'f', index, 0);
+            push_op(trace, 'a', index, 1 + rand_r(&seed) % 4);
+        }
+    } else {
+        trace_free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_latency(const char *name, double *cyc, int n, double mhz) {
+    if (n == 0) return;
+    qsort(cyc, n, sizeof(double), cmp_double);
+    double p50 = cyc[n / 2], p99 = cyc[(int)(n * 0.99)], p999 = cyc[(int)(n * 0.999)];
+    printf("%-6s %9d %10.0f %10.0f %10.0f %10.0f   (%.0f/%.0f/%.0f ns)\n", name, n,
+           p50, p99, p999, cyc[n - 1], p50 * 1e3 / mhz, p99 * 1e3 / mhz, p999 * 1e3 / mhz);
+}
+
+/*
+ * Replay a trace against a fresh region. With `cyc` set, each request is
+ * timed on its own and its latency stored there, else the whole run is timed.
+ * Blocks still allocated at the end are left so that fragmentation can be
+ * looked at, `blocks` holds them. Return the cycles taken.
+ */
+static double replay(trace_t *trace, void *region, void **blocks, double *cyc,
+                     int *fails) {
+    double total = 0, overhead = cyc == NULL? 0: ovhd();
+    memset(blocks, 0, trace->num_ids * sizeof(void *));
+    init_page(region, trace->pages);
+    *fails = 0;
+    if (cyc == NULL) start_counter();
+    for (int i = 0; i < trace->num_ops; ++i) {
+        const traceop_t *op = &trace->ops[i];
+        void **block = &blocks[op->index];
+        if (cyc != NULL) start_counter();
+        if (op->type == 'a') {
+            *block = alloc_pages(op->rank);
+        } else if (*block != NULL && !IS_ERR(*block)) {
+            return_pages(*block);
+        }
+        if (cyc != NULL) {
+            cyc[i] = get_counter() - overhead;
+            if (cyc[i] < 0) cyc[i] = 0;
+        }
+        if (op->type == 'a' && IS_ERR(*block)) ++*fails;
+        if (op->type == 'f') *block = NULL;
+    }
+    if (cyc == NULL) total = get_counter();
+    return total;
+}
+
+/*
+ * Locality of the blocks still allocated: how many 2 MiB regions they are
+ * spread over against the fewest that could hold them, and the cycles per page
+ * to touch them in id order, which grow with TLB misses.
+ */
+static void print_locality(trace_t *trace, void *region, void **blocks) {
+    size_t huge_num = ((size_t)trace->pages * PAGE + HUGE_PAGE - 1) / HUGE_PAGE;
+    char *touched = calloc(huge_num, 1);
+    long live = 0, spanned = 0;
+    if (touched == NULL) return;
+    for (int i = 0; i < trace->num_ids; ++i) {
+        if (blocks[i] == NULL || IS_ERR(blocks[i])) continue;
+        long pages = 1L << (query_ranks(blocks[i]) - 1);
+        size_t first = (blocks[i] - region) / HUGE_PAGE;
+        size_t last = (blocks[i] - region + pages * PAGE - 1) / HUGE_PAGE;
+        for (size_t h = first; h <= last; ++h) {
+            spanned += !touched[h];
+            touched[h] = 1;
+        }
+        live += pages;
+    }
+    free(touched);
+
+    start_counter();
+    for (int i = 0; i < trace->num_ids; ++i) {
+        if (blocks[i] == NULL || IS_ERR(blocks[i])) continue;
+        long pages = 1L << (query_ranks(blocks[i]) - 1);
+        for (long j = 0; j < pages; ++j) ((volatile char *)blocks[i])[j * PAGE]++;
+    }
+    double cyc = get_counter();
+    // the first pass faults pages in, time the second
+    start_counter();
+    for (int i = 0; i < trace->num_ids; ++i) {
+        if (blocks[i] == NULL || IS_ERR(blocks[i])) continue;
+        long pages = 1L << (query_ranks(blocks[i]) - 1);
+        for (long j = 0; j < pages; ++j) ((volatile char *)blocks[i])[j * PAGE]++;
+    }
+    cyc = get_counter();
+    printf("\n%ld live pages over %ld 2 MiB regions (at best %ld), %.1f cycles/page to touch\n",
+           live, spanned, (live * PAGE + HUGE_PAGE - 1) / HUGE_PAGE, live? cyc / live: 0);
+}
+
+int main(int argc, char *argv[]) {
+    char *tracefile = NULL, *pattern = "random", *outfile = NULL;
+    int num_ops = 1000000, pages = 1 << 15, cached = 0, lazy = 0, ordered = 0, c;
+    unsigned seed = 1;
+
+    while ((c = getopt(argc, argv, "f:g:n:p:s:w:cl:oh")) != EOF) {
+        switch (c) {
+            case 'f': tracefile = optarg; break;
+            case 'g': pattern = optarg; break;
+            case 'n': num_ops = atoi(optarg); break;
+            case 'p': pages = atoi(optarg); break;
+            case 's': seed = atoi(optarg); break;
+            case 'w': outfile = optarg; break;
+            case 'c': cached = 1; break;
+            case 'l': lazy = atoi(optarg); break;
+            case 'o': ordered = 1; break;
+            default: usage();
+        }
+    }
+    if (num_ops < 1 || pages < 1 || lazy < 0) usage();
+
+    trace_t *trace = tracefile != NULL? read_trace(tracefile):
+        gen_trace(pattern, pages, num_ops, seed);
+    if (trace == NULL) {
+        if (tracefile == NULL) fprintf(stderr, "unknown pattern %s\n", pattern);
+        return 1;
+    }
+    if (outfile != NULL) return write_trace(trace, outfile) == 0? 0: 1;
+
+    // pages are only backed once touched, so regions may exceed physical memory
+    size_t region_size = (size_t)trace->pages * PAGE;
+    void *region = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) region = NULL;
+    void **blocks = malloc(trace->num_ids * sizeof(void *));
+    double *cyc = malloc(trace->num_ops * sizeof(double));
+    double *alloc_cyc = malloc(trace->num_ops * sizeof(double));
+    if (region == NULL || blocks == NULL || cyc == NULL || alloc_cyc == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    if (cached) pcp_config(64, 16, 16);
+    if (lazy) lazy_config(lazy);
+    if (ordered) addr_order_config(~0UL);
+    double mhz = mhz_full(0, 1);
+    int fails;
+
+    printf("trace %s: %d pages, %d requests\n",
+           tracefile != NULL? tracefile: pattern, trace->pages, trace->num_ops);
+
+    // throughput, with the best of a few untimed runs
+    double best = 0;
+    for (int i = 0; i < 3; ++i) {
+        double t = replay(trace, region, blocks, NULL, &fails);
+        if (i == 0 || t < best) best = t;
+    }
+    printf("throughput %.0f ops/s, %d failed allocations\n\n",
+           trace->num_ops / (best / (mhz * 1e6)), fails);
+
+    // latency, per request
+    replay(trace, region, blocks, cyc, &fails);
+    int allocs = 0, frees = 0;
+    for (int i = 0; i < trace->num_ops; ++i) {
+        if (trace->ops[i].type == 'a') alloc_cyc[allocs++] = cyc[i];
+        else cyc[frees++] = cyc[i];
+    }
+    printf("%-6s %9s %10s %10s %10s %10s   (cycles)\n", "op", "count", "p50", "p99", "p999", "max");
+    print_latency("alloc", alloc_cyc, allocs, mhz);
+    print_latency("free", cyc, frees, mhz);
+
+    if (cached) pcp_drain();
+    print_locality(trace, region, blocks);
+    printf("\n");
+    dump_stats(stdout);
+
+    for (int i = 0; i < trace->num_ids; ++i)
+        if (blocks[i] != NULL && !IS_ERR(blocks[i])) return_pages(blocks[i]);
+    free(alloc_cyc);
+    free(cyc);
+    free(blocks);
+    munmap(region, region_size);
+    trace_free(trace);
+    return 0;
+}
@@ -0,0 +1,268 @@
+#include "slab.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGE_SIZE (1u << 12)
+
+// slabs are the smallest blocks holding SLAB_MIN_OBJS objects, up to this rank
+#define SLAB_MAX_RANK 6
+#define SLAB_MIN_OBJS 8
+// empty slabs kept per cache before they are returned to the page allocator
+#define SLAB_KEEP_EMPTY 1
+
+typedef struct slab_t slab_t;
+
+/*
+ * A slab starts with its descriptor, followed by a stack of the indices of its
+ * free objects, a bitmap of those in use and then the objects themselves.
+ * Keeping the free list out of the objects leaves constructed objects
+ * untouched while they are free, the bitmap turns away objects freed twice.
+ */
+struct slab_t {
+    slab_t *prev, *next;
+    kmem_cache_t *cache;
+    uint32_t inuse;
+    uint32_t free_num;
+    uint16_t free_idx[];
+};
+
+enum { SLAB_FULL, SLAB_PARTIAL, SLAB_EMPTY, SLAB_LISTS };
+
+/*
+ * Slabs come from one region, so they all lie a multiple of their size apart.
+ * The slab of an object is thus found by rounding its offset from any known
+ * slab, `anchor`, down to the slab size, and the first object sits at the same
+ * offset `obj_off` in every slab.
+ */
+struct kmem_cache {
+    const char *name;
+    size_t size, align, stride;
+    void (*ctor)(void *);
+    int rank;
+    size_t slab_size;
+    uint32_t per_slab;
+    // 2^40 / stride rounded up, to find object indices without dividing
+    uint64_t recip;
+    uintptr_t anchor;
+    size_t map_off, obj_off;
+
+    pthread_mutex_t lock;
+    slab_t *slabs[SLAB_LISTS];
+    uint32_t slab_num[SLAB_LISTS];
+    uint64_t allocs, frees, alloc_fails;
+    uint64_t slab_allocs, slab_frees;
+};
+
+static size_t align_up(size_t x, size_t align) {
+    return (x + align - 1) & ~(align - 1);
+}
+
+static void slab_link(kmem_cache_t *cache, int list, slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = cache->slabs[list];
+    if (slab->next != NULL) slab->next->prev = slab;
+    cache->slabs[list] = slab;
+    cache->slab_num[list]++;
+}
+
+static void slab_unlink(kmem_cache_t *cache, int list, slab_t *slab) {
+    if (slab->next != NULL) slab->next->prev = slab->prev;
+    if (slab->prev != NULL) slab->prev->next = slab->next;
+    else cache->slabs[list] = slab->next;
+    cache->slab_num[list]--;
+}
+
+// bytes of the bitmap of `n` objects
+static size_t map_bytes(size_t n) {
+    return (n + 63) / 64 * sizeof(uint64_t);
+}
+
+static uint64_t *slab_map(kmem_cache_t *cache, slab_t *slab) {
+    return (uint64_t *)((char *)slab + cache->map_off);
+}
+
+// objects fitting in a slab of `bytes`, with room to align the bitmap and the first object
+static uint32_t slab_capacity(size_t bytes, size_t stride, size_t align) {
+    size_t head = sizeof(slab_t) + sizeof(uint64_t) - 1 + align - 1;
+    if (bytes <= head) return 0;
+    size_t n = (bytes - head) / (stride + sizeof(uint16_t));
+    if (n > UINT16_MAX) n = UINT16_MAX;
+    while (n > 0 && head + n * (stride + sizeof(uint16_t)) + map_bytes(n) > bytes) n--;
+    return n;
+}
+
+static slab_t *slab_create(kmem_cache_t *cache) {
+    slab_t *slab = alloc_pages(cache->rank);
+    if (IS_ERR(slab)) return NULL;
+    if (cache->anchor == 0) {
+        cache->anchor = (uintptr_t)slab;
+        cache->map_off = align_up(sizeof(slab_t) + cache->per_slab * sizeof(uint16_t),
+                                  sizeof(uint64_t));
+        size_t head = cache->map_off + map_bytes(cache->per_slab);
+        cache->obj_off = align_up((uintptr_t)slab + head, cache->align) - (uintptr_t)slab;
+    }
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free_num = cache->per_slab;
+    // lower objects are handed out first
+    for (uint32_t i = 0; i < cache->per_slab; ++i)
+        slab->free_idx[i] = cache->per_slab - 1 - i;
+    memset(slab_map(cache, slab), 0, map_bytes(cache->per_slab));
+    if (cache->ctor != NULL) {
+        char *obj = (char *)slab + cache->obj_off;
+        for (uint32_t i = 0; i < cache->per_slab; ++i, obj += cache->stride)
+            cache->ctor(obj);
+    }
+    cache->slab_allocs++;
+    return slab;
+}
+
+static void slab_release(kmem_cache_t *cache, slab_t *slab) {
+    return_pages(slab);
+    cache->slab_frees++;
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                void (*ctor)(void *)) {
+    if (align == 0) align = sizeof(void *);
+    if (size == 0 || (align & (align - 1)) != 0) return ERR_PTR(-EINVAL);
+    size_t stride = align_up(size, align);
+
+    int rank;
+    uint32_t per_slab = 0;
+    for (rank = 1; rank <= SLAB_MAX_RANK; ++rank) {
+        per_slab = slab_capacity((size_t)PAGE_SIZE << (rank - 1), stride, align);
+        if (per_slab >= SLAB_MIN_OBJS) break;
+    }
+    // huge objects make do with fewer per slab
+    if (rank > SLAB_MAX_RANK) rank = SLAB_MAX_RANK;
+    if (per_slab == 0) return ERR_PTR(-EINVAL);
+
+    kmem_cache_t *cache = calloc(1, sizeof(kmem_cache_t));
+    if (cache == NULL) return ERR_PTR(-ENOMEM);
+    cache->name = name;
+    cache->size = size;
+    cache->align = align;
+    cache->stride = stride;
+    cache->ctor = ctor;
+    cache->rank = rank;
+    cache->slab_size = (size_t)PAGE_SIZE << (rank - 1);
+    cache->per_slab = per_slab;
+    cache->recip = ((1ull << 40) + stride - 1) / stride;
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+// objects still in use are released along with their slabs
+void kmem_cache_destroy(kmem_cache_t *cache) {
+    if (cache == NULL || IS_ERR(cache)) return;
+    for (int list = 0; list < SLAB_LISTS; ++list) {
+        for (slab_t *slab = cache->slabs[list], *next; slab != NULL; slab = next) {
+            next = slab->next;
+            return_pages(slab);
+        }
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    pthread_mutex_lock(&cache->lock);
+    slab_t *slab = cache->slabs[SLAB_PARTIAL];
+    if (slab != NULL) {
+        if (slab->free_num == 1) {
+            slab_unlink(cache, SLAB_PARTIAL, slab);
+            slab_link(cache, SLAB_FULL, slab);
+        }
+    } else {
+        slab = cache->slabs[SLAB_EMPTY];
+        if (slab != NULL) slab_unlink(cache, SLAB_EMPTY, slab);
+        else slab = slab_create(cache);
+        if (slab == NULL) {
+            cache->alloc_fails++;
+            pthread_mutex_unlock(&cache->lock);
+            return ERR_PTR(-ENOSPC);
+        }
+        slab_link(cache, slab->free_num == 1? SLAB_FULL: SLAB_PARTIAL, slab);
+    }
+    uint16_t idx = slab->free_idx[--slab->free_num];
+    slab_map(cache, slab)[idx / 64] |= 1ull << (idx % 64);
+    slab->inuse++;
+    cache->allocs++;
+    pthread_mutex_unlock(&cache->lock);
+    return (char *)slab + cache->obj_off + idx * cache->stride;
+}
+
+int kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (cache == NULL || obj == NULL || cache->anchor == 0) return -EINVAL;
+    uintptr_t off = ((uintptr_t)obj - cache->anchor) & (cache->slab_size - 1);
+    slab_t *slab = (slab_t *)((uintptr_t)obj - off);
+    if (off < cache->obj_off) return -EINVAL;
+    // exact as long as offset times stride stays below 2^40, true within a slab
+    uint32_t idx = ((off - cache->obj_off) * cache->recip) >> 40;
+    if (idx >= cache->per_slab || idx * cache->stride != off - cache->obj_off) return -EINVAL;
+
+    pthread_mutex_lock(&cache->lock);
+    // an object freed twice is found free in a slab still in use
+    uint64_t *map = slab_map(cache, slab);
+    if (slab->cache != cache || !(map[idx / 64] >> (idx % 64) & 1)) {
+        pthread_mutex_unlock(&cache->lock);
+        return -EINVAL;
+    }
+    map[idx / 64] &= ~(1ull << (idx % 64));
+    if (slab->free_num == 0) {
+        slab_unlink(cache, SLAB_FULL, slab);
+        slab_link(cache, SLAB_PARTIAL, slab);
+    }
+    slab->free_idx[slab->free_num++] = idx;
+    slab->inuse--;
+    cache->frees++;
+    if (slab->inuse == 0) {
+        slab_unlink(cache, SLAB_PARTIAL, slab);
+        if (cache->slab_num[SLAB_EMPTY] < SLAB_KEEP_EMPTY) {
+            slab_link(cache, SLAB_EMPTY, slab);
+        } else {
+            slab->cache = NULL;
+            slab_release(cache, slab);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return OK;
+}
+
+int kmem_cache_shrink(kmem_cache_t *cache) {
+    int released = 0;
+    pthread_mutex_lock(&cache->lock);
+    while (cache->slabs[SLAB_EMPTY] != NULL) {
+        slab_t *slab = cache->slabs[SLAB_EMPTY];
+        slab_unlink(cache, SLAB_EMPTY, slab);
+        slab->cache = NULL;
+        slab_release(cache, slab);
+        released++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return released;
+}
+
+int kmem_cache_stats(kmem_cache_t *cache, struct kmem_cache_stats *stats) {
+    if (cache == NULL || stats == NULL) return -EINVAL;
+    pthread_mutex_lock(&cache->lock);
+    stats->obj_size = cache->stride;
+    stats->objs_per_slab = cache->per_slab;
+    stats->slab_rank = cache->rank;
+    stats->slabs_full = cache->slab_num[SLAB_FULL];
+    stats->slabs_partial = cache->slab_num[SLAB_PARTIAL];
+    stats->slabs_empty = cache->slab_num[SLAB_EMPTY];
+    stats->objs_active = cache->allocs - cache->frees;
+    stats->objs_total = (uint64_t)cache->per_slab *
+        (stats->slabs_full + stats->slabs_partial + stats->slabs_empty);
+    stats->allocs = cache->allocs;
+    stats->frees = cache->frees;
+    stats->alloc_fails = cache->alloc_fails;
+    stats->slab_allocs = cache->slab_allocs;
+    stats->slab_frees = cache->slab_frees;
+    pthread_mutex_unlock(&cache->lock);
+    return OK;
+}
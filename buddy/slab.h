@@ -0,0 +1,39 @@
+#ifndef OS_SLAB_H
+#define OS_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buddy.h"
+
+/*
+ * Object caches on top of the page allocator. A cache hands out objects of a
+ * single size carved from slabs, which are blocks obtained from alloc_pages()
+ * and given back with return_pages() once none of their objects is in use.
+ * An optional constructor runs once per object when its slab is created, and
+ * freed objects are expected to be left in their constructed state.
+ *
+ * Caches must be destroyed before the page allocator is initialized again.
+ */
+typedef struct kmem_cache kmem_cache_t;
+
+struct kmem_cache_stats {
+    size_t obj_size;            /* bytes between neighbouring objects */
+    uint32_t objs_per_slab;
+    int slab_rank;              /* rank of the blocks backing the slabs */
+    uint32_t slabs_full, slabs_partial, slabs_empty;
+    uint64_t objs_active, objs_total;
+    uint64_t allocs, frees, alloc_fails;
+    uint64_t slab_allocs, slab_frees;
+};
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                void (*ctor)(void *));
+void kmem_cache_destroy(kmem_cache_t *cache);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+int kmem_cache_free(kmem_cache_t *cache, void *obj);
+/* return every empty slab to the page allocator, return how many were */
+int kmem_cache_shrink(kmem_cache_t *cache);
+int kmem_cache_stats(kmem_cache_t *cache, struct kmem_cache_stats *stats);
+
+#endif
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "buddy.h"
+#include "slab.h"
+
+#define PAGE (1024 * 4)
+#define POOLRANK (16)
+#define POOLPAGE (1 << (POOLRANK - 1))
+#define ROUNDS (1 << 21)
+#define BATCH (1024)
+#define REPEAT (5)
+
+static void *pool;
+static void *objs[BATCH];
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Allocate BATCH objects, then free them in reverse order. */
+static double batch_slab(size_t size) {
+    init_page(pool, POOLPAGE);
+    kmem_cache_t *cache = kmem_cache_create("bench", size, 0, NULL);
+    double t = now_ns();
+    for (long i = 0; i < ROUNDS; i += BATCH) {
+        for (int j = 0; j < BATCH; ++j) objs[j] = kmem_cache_alloc(cache);
+        for (int j = BATCH - 1; j >= 0; --j) kmem_cache_free(cache, objs[j]);
+    }
+    t = now_ns() - t;
+    kmem_cache_destroy(cache);
+    return t / ROUNDS;
+}
+
+static double batch_malloc(size_t size) {
+    double t = now_ns();
+    for (long i = 0; i < ROUNDS; i += BATCH) {
+        for (int j = 0; j < BATCH; ++j) objs[j] = malloc(size);
+        for (int j = BATCH - 1; j >= 0; --j) free(objs[j]);
+    }
+    return (now_ns() - t) / ROUNDS;
+}
+
+/* Keep BATCH objects live and replace a random one at every step. */
+static double churn_slab(size_t size) {
+    init_page(pool, POOLPAGE);
+    kmem_cache_t *cache = kmem_cache_create("bench", size, 0, NULL);
+    unsigned seed = 1;
+    for (int j = 0; j < BATCH; ++j) objs[j] = kmem_cache_alloc(cache);
+    double t = now_ns();
+    for (long i = 0; i < ROUNDS; ++i) {
+        int k = rand_r(&seed) % BATCH;
+        kmem_cache_free(cache, objs[k]);
+        objs[k] = kmem_cache_alloc(cache);
+    }
+    t = now_ns() - t;
+    kmem_cache_destroy(cache);
+    return t / ROUNDS;
+}
+
+static double churn_malloc(size_t size) {
+    unsigned seed = 1;
+    for (int j = 0; j < BATCH; ++j) objs[j] = malloc(size);
+    double t = now_ns();
+    for (long i = 0; i < ROUNDS; ++i) {
+        int k = rand_r(&seed) % BATCH;
+        free(objs[k]);
+        objs[k] = malloc(size);
+    }
+    t = now_ns() - t;
+    for (int j = 0; j < BATCH; ++j) free(objs[j]);
+    return t / ROUNDS;
+}
+
+/* Run a benchmark several times and return its best run. */
+static double best(double (*bench)(size_t), size_t size) {
+    double ns = bench(size);
+    for (int i = 1; i < REPEAT; ++i) {
+        double t = bench(size);
+        if (t < ns) ns = t;
+    }
+    return ns;
+}
+
+int main() {
+    static const size_t sizes[] = {32, 64, 128, 256, 512};
+    pool = malloc((size_t)POOLPAGE * PAGE);
+    if (pool == NULL) return 1;
+
+    printf("Slab cache benchmark (%d objects per batch, ns/op)\n", BATCH);
+    printf("%6s %10s %10s %10s %10s\n", "size", "batch", "malloc", "churn", "malloc");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        printf("%6zu %10.2f %10.2f %10.2f %10.2f\n", sizes[i],
+               best(batch_slab, sizes[i]), best(batch_malloc, sizes[i]),
+               best(churn_slab, sizes[i]), best(churn_malloc, sizes[i]));
+    }
+
+    // what a cache looks like after a churn run
+    init_page(pool, POOLPAGE);
+    kmem_cache_t *cache = kmem_cache_create("stats", 200, 0, NULL);
+    unsigned seed = 1;
+    for (int j = 0; j < BATCH; ++j) objs[j] = NULL;
+    for (long i = 0; i < ROUNDS; ++i) {
+        int k = rand_r(&seed) % BATCH;
+        if (objs[k] != NULL && !IS_ERR(objs[k])) {
+            kmem_cache_free(cache, objs[k]);
+            objs[k] = NULL;
+        } else {
+            objs[k] = kmem_cache_alloc(cache);
+        }
+    }
+    struct kmem_cache_stats st;
+    kmem_cache_stats(cache, &st);
+    printf("\ncache of %zu-byte objects, %u per rank %d slab:\n",
+           st.obj_size, st.objs_per_slab, st.slab_rank);
+    printf("  slabs full/partial/empty  %u/%u/%u\n",
+           st.slabs_full, st.slabs_partial, st.slabs_empty);
+    printf("  objects active/total      %lu/%lu\n",
+           (unsigned long)st.objs_active, (unsigned long)st.objs_total);
+    printf("  allocs/frees/fails        %lu/%lu/%lu\n", (unsigned long)st.allocs,
+           (unsigned long)st.frees, (unsigned long)st.alloc_fails);
+    printf("  slabs created/released    %lu/%lu\n",
+           (unsigned long)st.slab_allocs, (unsigned long)st.slab_frees);
+    kmem_cache_destroy(cache);
+    free(pool);
+    return 0;
+}
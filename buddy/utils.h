@@ -1,11 +1,11 @@
 #define ok(expr)                                                         \
     do {                                                                 \
         if (!((expr) || fake_mode)) {                                    \
-            printf("[%d]Assertion failed: " #expr " at line %d\n", tCnt, \
+            printf("[%d]Assertion failed: %s at line %d\n", tCnt, #expr, \
                    __LINE__);                                            \
             if (!cont) exit(-1);                                         \
         } else {                                                         \
-            printf("[%d]Ok: " #expr " at line %d\n", tCnt, __LINE__);    \
+            printf("[%d]Ok: %s at line %d\n", tCnt, #expr, __LINE__);    \
             tCnt++;                                                      \
         }                                                                \
     } while (0)
@@ -14,7 +14,7 @@
     do {                                                                 \
         if (!((expr) || fake_mode)) {                                    \
             printf("X==>FAILED!\n");                                     \
-            printf("[%d]Assertion failed: " #expr " at line %d\n", tCnt, \
+            printf("[%d]Assertion failed: %s at line %d\n", tCnt, #expr, \
                    __LINE__);                                            \
             if (!cont) exit(-1);                                         \
         } else {                                                         \
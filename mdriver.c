@@ -10,6 +10,8 @@
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
+#include <pthread.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -103,6 +105,7 @@ typedef struct {
 
 	/* defined only for the student malloc package */
 	double util;     /* space utilization for this trace (always 0 for libc) */
+	double mt_secs;  /* secs for num_threads threads to each run the trace */
 
 	/* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -132,6 +135,11 @@ int verbose = 1;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 int onetime_flag = 0;
 
+/* threads replaying each trace at once, 0 to skip (-T) */
+static int num_threads = 0;
+/* if set, blocks are freed by another thread than their own (-x) */
+static int cross_free = 0;
+
 /* by default, no timeouts */
 static int set_timeout = 0;
 
@@ -178,9 +186,11 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum);
 static void eval_mm_speed(void *ptr);
+static double eval_mm_threads(trace_t *trace, int n);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printthreads(int n, stats_t *stats);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
 	__attribute__((format(printf, 3,4)));
@@ -238,6 +248,8 @@ static void run_tests(int num_tracefiles, char trace_from_stdin,
 			if (verbose > 1)
 				printf("and performance.\n");
 			mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+			if (num_threads > 0)
+				mm_stats[i].mt_secs = eval_mm_threads(trace, num_threads);
 		}
 		free_trace(trace);
 	}
@@ -275,10 +287,10 @@ int main(int argc, char **argv)
 	 * Read and interpret the command line arguments
 	 */
 #ifdef OJ
-		num_tracefiles = 1;
-		trace_from_stdin = 1;
-#else
-	while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlDj")) != EOF) {
+	num_tracefiles = 1;
+	trace_from_stdin = 1;
+#endif
+	while ((c = getopt(argc, argv, "d:f:c:s:t:T:v:hVAlDjx")) != EOF) {
 		switch (c) {
 
 			case 'A': /* Hidden Autolab driver argument */
@@ -287,6 +299,7 @@ int main(int argc, char **argv)
 
 			case 'f': /* Use one specific trace file only (relative to curr dir) */
 				num_tracefiles = 1;
+				trace_from_stdin = 0;
 				if ((tracefiles = realloc(tracefiles, 2 * sizeof(char *))) == NULL)
 					unix_error("ERROR: realloc failed in main");
 				strcpy(tracedir, "./");
@@ -296,6 +309,7 @@ int main(int argc, char **argv)
 
 			case 'c': /* Use one specific trace file and run only once */
 				num_tracefiles = 1;
+				trace_from_stdin = 0;
 				onetime_flag = 1;
 				if ((tracefiles = realloc(tracefiles, 2 * sizeof(char *))) == NULL)
 					unix_error("ERROR: realloc failed in main");
@@ -312,6 +326,14 @@ int main(int argc, char **argv)
 					strcat(tracedir, "/"); /* path always ends with "/" */
 				break;
 
+			case 'T': /* Replay each trace in several threads at once */
+				num_threads = atoi(optarg);
+				break;
+
+			case 'x': /* Free blocks in the next thread with -T */
+				cross_free = 1;
+				break;
+
 			case 'l': /* Run libc malloc */
 				run_libc = 1;
 				break;
@@ -350,7 +372,6 @@ int main(int argc, char **argv)
 				exit(1);
 		}
 	}
-#endif
 
 	if (trace_from_stdin) {
 		printf("Using stdin as tracefile\n");
@@ -443,6 +464,10 @@ int main(int argc, char **argv)
 			printf("\nResults for mm malloc:\n");
 			printresults(num_tracefiles, mm_stats);
 			printf("\n");
+			if (num_threads > 0) {
+				printthreads(num_tracefiles, mm_stats);
+				printf("\n");
+			}
 		}
 	}
 
@@ -1196,6 +1221,261 @@ static void eval_mm_speed(void *ptr)
 		}
 }
 
+/*
+ * The state of one thread in eval_mm_threads: its own blocks array, so
+ * that the threads replay the trace independently, and the tag byte
+ * written into each payload it owns. With cross_free set, the blocks a
+ * thread frees are passed on XFER_BATCH at a time to the inbox of the
+ * next thread, which frees them, so that they go back to an allocator
+ * state of another thread. A thread waits while the inbox of the next
+ * holds XFER_MAX blocks, so that the blocks in flight stay bounded when
+ * the threads do not run side by side.
+ */
+#define XFER_BATCH 64
+#define XFER_MAX (4 * XFER_BATCH)
+
+typedef struct thread_arg {
+	trace_t *trace;
+	char **blocks;
+	unsigned char tag;
+	int fails;             /* NULL returns, e.g. with the heap exhausted */
+	int corrupt;           /* payloads whose tag was overwritten */
+	double start, end;     /* when the thread started and finished the trace */
+
+	struct thread_arg *next;
+	char *outbox[XFER_BATCH];
+	int outbox_num;
+	pthread_mutex_t inbox_lock;
+	char **inbox;          /* blocks freed in other threads, for this one */
+	int inbox_num, inbox_cap;
+} thread_arg_t;
+
+static pthread_barrier_t thread_barrier;
+static int trace_threads;  /* threads running the trace */
+static int threads_done;   /* threads done passing on blocks */
+
+static double now_secs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void tag_block(char *p, size_t size, unsigned char tag)
+{
+	if (size > 0) {
+		p[0] = tag;
+		p[size - 1] = tag;
+	}
+}
+
+static void drain_inbox(thread_arg_t *arg);
+
+/* Pass the blocks in the outbox on to the next thread */
+static void xfer_blocks(thread_arg_t *arg)
+{
+	thread_arg_t *next = arg->next;
+
+	pthread_mutex_lock(&next->inbox_lock);
+	while (next != arg && next->inbox_num >= XFER_MAX) {
+		/* freeing ours lets a ring of waiting threads go on */
+		pthread_mutex_unlock(&next->inbox_lock);
+		drain_inbox(arg);
+		sched_yield();
+		pthread_mutex_lock(&next->inbox_lock);
+	}
+	if (next->inbox_num + arg->outbox_num > next->inbox_cap) {
+		next->inbox_cap = 2 * next->inbox_cap + XFER_BATCH;
+		next->inbox = realloc(next->inbox, next->inbox_cap * sizeof(char *));
+		if (next->inbox == NULL)
+			unix_error("realloc failed in xfer_blocks");
+	}
+	memcpy(next->inbox + next->inbox_num, arg->outbox,
+			arg->outbox_num * sizeof(char *));
+	next->inbox_num += arg->outbox_num;
+	pthread_mutex_unlock(&next->inbox_lock);
+	arg->outbox_num = 0;
+}
+
+/* Free the blocks passed on to this thread */
+static void drain_inbox(thread_arg_t *arg)
+{
+	char **inbox;
+	int i, num;
+
+	pthread_mutex_lock(&arg->inbox_lock);
+	inbox = arg->inbox;
+	num = arg->inbox_num;
+	arg->inbox = NULL;
+	arg->inbox_num = arg->inbox_cap = 0;
+	pthread_mutex_unlock(&arg->inbox_lock);
+
+	for (i = 0; i < num; i++)
+		mm_free(inbox[i]);
+	free(inbox);
+}
+
+static void *eval_mm_thread(void *ptr)
+{
+	thread_arg_t *arg = ptr;
+	trace_t *trace = arg->trace;
+	char **blocks = arg->blocks;
+	size_t *sizes = (size_t *)(blocks + trace->num_ids);
+	int i, index;
+	size_t size;
+	char *p;
+
+	pthread_barrier_wait(&thread_barrier);
+	arg->start = now_secs();
+	for (i = 0;  i < trace->num_ops;  i++) {
+		index = trace->ops[i].index;
+		size = trace->ops[i].size;
+		switch (trace->ops[i].type) {
+
+			case ALLOC:
+				if ((p = mm_malloc(size)) == NULL)
+					arg->fails++;
+				else
+					tag_block(p, size, arg->tag);
+				blocks[index] = p;
+				sizes[index] = size;
+				break;
+
+			case REALLOC:
+				p = blocks[index];
+				if (p != NULL && sizes[index] > 0 && p[0] != (char)arg->tag)
+					arg->corrupt++;
+				if ((p = mm_realloc(p, size)) == NULL && size != 0)
+					arg->fails++;
+				if (p != NULL)
+					tag_block(p, size, arg->tag);
+				blocks[index] = p;
+				sizes[index] = size;
+				break;
+
+			case FREE:
+				if (index < 0)
+					break;
+				p = blocks[index];
+				if (p != NULL && sizes[index] > 0 &&
+						(p[0] != (char)arg->tag ||
+						 p[sizes[index] - 1] != (char)arg->tag))
+					arg->corrupt++;
+				blocks[index] = NULL;
+				if (!cross_free) {
+					mm_free(p);
+					break;
+				}
+				arg->outbox[arg->outbox_num++] = p;
+				if (arg->outbox_num == XFER_BATCH) {
+					xfer_blocks(arg);
+					drain_inbox(arg);
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+	if (cross_free) {
+		xfer_blocks(arg);
+		__atomic_add_fetch(&threads_done, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&threads_done, __ATOMIC_SEQ_CST) < trace_threads) {
+			drain_inbox(arg);
+			sched_yield();
+		}
+		drain_inbox(arg);
+	}
+	arg->end = now_secs();
+	return NULL;
+}
+
+/*
+ * eval_mm_threads_once - Run the trace in n threads at once on a fresh
+ *    heap, each with its own blocks, and return the wall clock secs from
+ *    the first thread starting to the last one finishing.
+ *    Blocks left allocated by the trace are freed untimed afterwards.
+ */
+static double eval_mm_threads_once(trace_t *trace, int n)
+{
+	pthread_t *tids;
+	thread_arg_t *args;
+	double start = DBL_MAX, end = 0;
+	int i, j, fails = 0, corrupt = 0;
+
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in eval_mm_threads");
+
+	tids = malloc(n * sizeof(pthread_t));
+	args = calloc(n, sizeof(thread_arg_t));
+	if (tids == NULL || args == NULL)
+		unix_error("malloc failed in eval_mm_threads");
+	pthread_barrier_init(&thread_barrier, NULL, n + 1);
+	threads_done = 0;
+	trace_threads = n;
+	for (i = 0; i < n; i++) {
+		args[i].trace = trace;
+		args[i].next = &args[(i + 1) % n];
+		pthread_mutex_init(&args[i].inbox_lock, NULL);
+		args[i].tag = 0x5a + i;
+		args[i].blocks = calloc(trace->num_ids, sizeof(char *) + sizeof(size_t));
+		if (args[i].blocks == NULL)
+			unix_error("calloc failed in eval_mm_threads");
+		if (pthread_create(&tids[i], NULL, eval_mm_thread, &args[i]) != 0)
+			unix_error("pthread_create failed in eval_mm_threads");
+	}
+
+	pthread_barrier_wait(&thread_barrier);
+
+	for (i = 0; i < n; i++) {
+		pthread_join(tids[i], NULL);
+		if (args[i].start < start)
+			start = args[i].start;
+		if (args[i].end > end)
+			end = args[i].end;
+		for (j = 0; j < trace->num_ids; j++)
+			mm_free(args[i].blocks[j]);
+		fails += args[i].fails;
+		corrupt += args[i].corrupt;
+		free(args[i].blocks);
+	}
+	pthread_barrier_destroy(&thread_barrier);
+	for (i = 0; i < n; i++)
+		pthread_mutex_destroy(&args[i].inbox_lock);
+	free(args);
+	free(tids);
+
+	if (corrupt) {
+		malloc_error(trace, trace->num_ops - 1,
+				"%d payloads overwritten while running in %d threads", corrupt, n);
+		errors++;
+	}
+	if (fails && verbose > 0)
+		printf("%s: %d requests failed in %d threads\n", trace->filename, fails, n);
+
+	return end - start;
+}
+
+/*
+ * eval_mm_threads - The best of MT_REPEAT runs of the trace in n threads,
+ *    the first of which mostly pays for faulting in the heap.
+ */
+#define MT_REPEAT 5
+
+static double eval_mm_threads(trace_t *trace, int n)
+{
+	double secs, best = DBL_MAX;
+	int i;
+
+	for (i = 0; i < MT_REPEAT; i++) {
+		secs = eval_mm_threads_once(trace, n);
+		if (secs < best)
+			best = secs;
+	}
+	return best;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1360,6 +1640,28 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printthreads - prints the throughput of running each trace in
+ *    num_threads threads at once, against a single thread
+ */
+static void printthreads(int n, stats_t *stats)
+{
+	int i;
+
+	printf("Throughput with %d threads%s:\n", num_threads,
+			cross_free ? ", freeing each other's blocks" : "");
+	printf("  %9s%12s%9s  %s\n", "secs", "Kops", "speedup", "trace");
+	for (i=0; i < n; i++) {
+		if (!stats[i].valid || stats[i].mt_secs == 0)
+			continue;
+		printf("  %9.6f%12.0f%8.2fx  %s\n",
+				stats[i].mt_secs,
+				(num_threads * stats[i].ops / 1e3) / stats[i].mt_secs,
+				num_threads * stats[i].secs / stats[i].mt_secs,
+				stats[i].filename);
+	}
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1405,12 +1707,14 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
  */
 static void usage(void)
 {
-	fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+	fprintf(stderr, "Usage: mdriver [-hlVdDx] [-T <n>] [-f <file>]\n");
 	fprintf(stderr, "Options\n");
 	fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
 	fprintf(stderr, "\t-D         Equivalent to -d2.\n");
 	fprintf(stderr, "\t-c <file>  Run trace file <file> once, check for correctness only.\n");
 	fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+	fprintf(stderr, "\t-T <n>     Also replay each trace in <n> threads at once.\n");
+	fprintf(stderr, "\t-x         With -T, have the next thread free each block.\n");
 	fprintf(stderr, "\t-h         Print this message.\n");
 	fprintf(stderr, "\t-l         Run libc malloc as well.\n");
 	fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
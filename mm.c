@@ -10,10 +10,18 @@
  * it never frees anything.
  */
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#if __has_include(<sys/single_threaded.h>)
+#include <sys/single_threaded.h>
+#else
+// never known to be alone, every call takes the arena locks
+#define __libc_single_threaded 0
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -63,7 +71,8 @@ typedef unsigned char uint8_t, byte_t;
 #define DWORD_SIZE (sizeof(dword_t))
 
 #define MIN_BLK_SIZE (WORD_SIZE*4)
-#define META_SIZE (WORD_SIZE*2)
+// allocated blocks keep their header only, the footer is for free blocks
+#define META_SIZE (WORD_SIZE)
 #define MAX(a, b) ((a) > (b)? (a): (b))
 #define MIN(a, b) ((a) < (b)? (a): (b))
 
@@ -74,16 +83,30 @@ typedef unsigned char uint8_t, byte_t;
 #define PTR_DIFF(ptr, base) ( (word_t) ((char*)(ptr) - (char*)(base)) )
 #define PTR_INCR(ptr, offset) ( (void*) ( (char*)(ptr) + (offset_t)(offset) ) )
 
-// zip information for block status (last 2 bits) and size (the rest bits)
-#define ZIP(size, status) (((size) & ~0x3) | ((status) & 0x3))
-#define UNZIP_SIZE(ptr) (GET(ptr) & ~0x3)
+// zip information for block status (last 3 bits) and size (the rest bits)
+#define ZIP(size, status) (((size) & ~0x7) | ((status) & 0x7))
+#define UNZIP_SIZE(ptr) (GET(ptr) & ~0x7)
 #define UNZIP_STAT(ptr) (GET(ptr) & 0x3)
+#define UNZIP_PRED(ptr) (GET(ptr) & PRED_USED)
 
-// possible status for a block
-#define UNDEF 0
+// possible status for a block, CACHED is a used one held in a thread cache
+#define CACHED 0
 #define USED 1
 #define UNUSED 2
 #define BORDER 3
+// set in a header while the block before is not free, which has no footer then
+#define PRED_USED 4
+
+// set or clear bits in a header that another thread may change at once: the
+// owner of a thread cache marks its blocks in and out without a lock, while
+// the owner of their arena sets PRED_USED in them, so both take the bits
+// atomically but in a process with a single thread
+#define SET_BITS(ptr, bits) (__libc_single_threaded? \
+    (void)(*(word_t*)(ptr) |= (bits)): \
+    (void)__atomic_fetch_or((word_t*)(ptr), (bits), __ATOMIC_RELAXED))
+#define CLR_BITS(ptr, bits) (__libc_single_threaded? \
+    (void)(*(word_t*)(ptr) &= ~(bits)): \
+    (void)__atomic_fetch_and((word_t*)(ptr), ~(bits), __ATOMIC_RELAXED))
 
 static void* heap_base;
 word_t border_offset;
@@ -91,6 +114,7 @@ word_t border_offset;
 #define HDR_PTR(ptr) PTR_INCR(ptr, -WORD_SIZE)
 #define SIZE(ptr) UNZIP_SIZE(HDR_PTR(ptr))
 #define STAT(ptr) UNZIP_STAT(HDR_PTR(ptr))
+#define PRED(ptr) UNZIP_PRED(HDR_PTR(ptr))
 #define FTR_PTR(ptr) PTR_INCR(ptr, SIZE(ptr) - 2*WORD_SIZE)
 #define NEX_PTR(ptr) (ptr)
 #define PRE_PTR(ptr) PTR_INCR(ptr, SIZE(ptr) - 3*WORD_SIZE)
@@ -100,61 +124,374 @@ word_t border_offset;
 #define HEAP_NEXT(ptr) PTR_INCR(ptr, SIZE(ptr))
 #define HEAP_PREV(ptr) PTR_INCR(ptr, -UNZIP_SIZE( PTR_INCR(ptr, -2*WORD_SIZE) ))
 
-#define MIN_BLK_BITS 8
-#define MAX_BLK_BITS 8
-#define STP_BLK_BITS 1
-#define RANK_NUM ((MAX_BLK_BITS - MIN_BLK_BITS) / STP_BLK_BITS + 1)
+/*
+ * Size classes: every block size below 1 << SMALL_BITS, a multiple of
+ * ALIGNMENT from MIN_BLK_SIZE on, has a class of its own, above that each
+ * power of two is cut into 1 << SUB_BITS classes up to 1 << HEAP_BITS, which
+ * no block reaches in the 100MB heap of memlib. A free block sits in the
+ * class its size rounds down to, so a request finds any block of a higher
+ * class large enough. The heads of the classes take heap space like the
+ * blocks do, so there are few of them: halves of the powers of two cost more
+ * in heads on the short traces than they save in fit on the long ones.
+ */
+#define SMALL_BITS 6
+#define SUB_BITS 0
+#define HEAP_BITS 27
+#define SMALL_NUM ((int)((1 << SMALL_BITS) - MIN_BLK_SIZE) / ALIGNMENT)
+#define LIST_NUM (SMALL_NUM + ((HEAP_BITS - SMALL_BITS) << SUB_BITS))
+
+/*
+ * Free blocks of TREE_MIN bytes and more are kept out of the classes, in a
+ * tree ordered by size and address that gives the best fit, lowest address
+ * first. 0 leaves them in the classes; on the default traces the tree costs
+ * more in throughput than it gains in utilization, so it is off unless built
+ * with -DTREE_MIN=<bytes>, as the Makefile does for code-tree.
+ */
+#ifndef TREE_MIN
+#define TREE_MIN 0
+#endif
+// the children of a node are in its second and third words, clear of the
+// footer only from 24 bytes on
+#if TREE_MIN && TREE_MIN < 24
+#error "TREE_MIN must be 0 or at least 24 bytes"
+#endif
+// the tree has a head after the lists, only when it is built in
+#define TREE_RANK LIST_NUM
+#define RANK_NUM (LIST_NUM + (TREE_MIN != 0))
+#define MASK_NUM ((RANK_NUM + 63) / 64)
 
 static inline int get_rank(word_t size) {
-    for (int i = MIN_BLK_BITS; i < MAX_BLK_BITS; i += STP_BLK_BITS)
-        if ((1u << i) >= size) return (i - MIN_BLK_BITS) / STP_BLK_BITS;
-    return (MAX_BLK_BITS - MIN_BLK_BITS) / STP_BLK_BITS;
+#if TREE_MIN
+    if (size >= TREE_MIN) return TREE_RANK;
+#endif
+    if (size < (1u << SMALL_BITS)) return (size - MIN_BLK_SIZE) / ALIGNMENT;
+    int bits = 31 - __builtin_clz(size);
+    word_t sub = (size >> (bits - SUB_BITS)) & ((1 << SUB_BITS) - 1);
+    return SMALL_NUM + ((bits - SMALL_BITS) << SUB_BITS) + sub;
 }
 
+/*
+ * Arenas: each has free lists of its own, and the blocks it hands out are
+ * freed back into it. Threads are bound to arenas round-robin and move
+ * on to another one when theirs is busy. The functions below work on the arena
+ * of the calling thread that it has locked, `arena`.
+ *
+ * The first arena starts at the bottom of the heap and grows in place as long
+ * as nothing else has been put above it, just like a single heap would. When
+ * an arena cannot grow in place it starts a chunk of at least ARENA_CHUNK
+ * bytes at the next ARENA_CHUNK boundary, so that every ARENA_CHUNK of the
+ * heap belongs to a single arena and the chunk map tells which.
+ *
+ * The tables of an arena live in the heap like its blocks: the heap starts
+ * with the table of the first arena, followed by the prologue. Any other
+ * arena is set up by the first thread bound to it, its table at the head of
+ * its first chunk. The first word of a chunk holds the size of that head.
+ * The chunk map, with the offsets of the other tables and the locks of all
+ * arenas, is only needed once there is a second arena, and comes in the head
+ * of the chunk of that one.
+ *
+ * Locking: a call made while the process has a single thread takes no lock,
+ * no other thread can come up before it returns. Otherwise a call locks its
+ * arena by the mutex in the chunk map. Until there is a map only the first
+ * arena is there, and it is locked by boot_busy instead; the thread setting
+ * up the map holds boot_busy meanwhile, so that once the map is out no call
+ * is still in the first arena on boot_busy. A thread holds one arena at most.
+ */
+#ifndef ARENA_NUM
+#define ARENA_NUM 8
+#endif
+#define CHUNK_BITS 16
+#define ARENA_CHUNK (1u << CHUNK_BITS)
+
+typedef struct {
+    word_t index;
+    word_t epilogue;    // of the chunk the arena grows
+    dword_t rank_mask[MASK_NUM];
+    word_t buckets[RANK_NUM];
+} arena_t;
+
+typedef struct {
+    word_t tables[ARENA_NUM];   // offsets of the arena tables, 0 if not set up
+    pthread_mutex_t locks[ARENA_NUM];
+    byte_t owner[1u << (32 - CHUNK_BITS)];
+} chunk_map_t;
+
+static word_t chunk_map;    // offset of the chunk map, 0 while it is not there
+static __thread arena_t *arena;
+
+#define MAP() ((chunk_map_t*)PTR_INCR(heap_base, chunk_map))
+#define ARENA_HEAD (2*WORD_SIZE + ALIGN(sizeof(arena_t)))
+
+// the table of arena idx, NULL while it is not set up
+static inline arena_t* arena_get(int idx) {
+    if (idx == 0) return heap_base;
+    if (__atomic_load_n(&chunk_map, __ATOMIC_ACQUIRE) == 0) return NULL;
+    word_t off = __atomic_load_n(&MAP()->tables[idx], __ATOMIC_ACQUIRE);
+    return off? PTR_INCR(heap_base, off): NULL;
+}
+
+static inline arena_t* arena_of(void *ptr) {
+    if (__atomic_load_n(&chunk_map, __ATOMIC_ACQUIRE) == 0) return heap_base;
+    return arena_get(MAP()->owner[PTR_DIFF(ptr, heap_base) >> CHUNK_BITS]);
+}
+
+#define OWNER(ptr) arena_of(ptr)
+
 #define BDR_OFF (border_offset)
 #define PRO_BDR_PTR PTR_INCR(heap_base, BDR_OFF) 
-#define EPI_BDR_PTR PTR_INCR(mem_heap_hi(), 1)
-#define BUCK(rank) PTR_INCR(heap_base, (rank) * WORD_SIZE)
+#define EPI_BDR_PTR PTR_INCR(heap_base, arena->epilogue)
+#define HEAP_END PTR_INCR(mem_heap_hi(), 1)
+
+#define MASK(idx) (arena->rank_mask[idx])
+#define BUCK(rank) (&arena->buckets[rank])
 #define LIST(rank) PTR_INCR(heap_base, GET(BUCK(rank)))
-#define RANK(size) (0)
+#define RANK(size) get_rank(size)
+
+#define MASK_SET(rank) (MASK((rank) >> 6) |= 1ull << ((rank) & 63))
+#define MASK_CLR(rank) (MASK((rank) >> 6) &= ~(1ull << ((rank) & 63)))
+
+// the first non-empty class from rank on, RANK_NUM if there is none
+static inline int next_rank(int rank) {
+    if (rank >= RANK_NUM) return RANK_NUM;
+    int idx = rank >> 6;
+    dword_t bits = MASK(idx) & (~0ull << (rank & 63));
+    while (bits == 0) {
+        if (++idx == MASK_NUM) return RANK_NUM;
+        bits = MASK(idx);
+    }
+    return (idx << 6) + __builtin_ctzll(bits);
+}
+
+/*
+ * The tree is a treap: a search tree on (size, address) that is also a heap
+ * on a hash of the address, which keeps it balanced in expectation without
+ * storing anything but the two children, in the words after NEX_PTR.
+ */
+#define LFT_PTR(ptr) PTR_INCR(ptr, WORD_SIZE)
+#define RGT_PTR(ptr) PTR_INCR(ptr, 2*WORD_SIZE)
+#define PRIO(off) ((word_t)(off) * 2654435761u)
+#define NODE(off) PTR_INCR(heap_base, off)
+#define NODE_LESS(a, b) (SIZE(a) < SIZE(b) || (SIZE(a) == SIZE(b) && (a) < (b)))
+
+// split the tree at root into the nodes before node and the rest
+static void tree_split(word_t root, void *node, word_t *lft, word_t *rgt) {
+    if (root == BDR_OFF) {
+        *lft = *rgt = BDR_OFF;
+    } else if (NODE_LESS(NODE(root), node)) {
+        *lft = root;
+        tree_split(GET(RGT_PTR(NODE(root))), node, (word_t*)RGT_PTR(NODE(root)), rgt);
+    } else {
+        *rgt = root;
+        tree_split(GET(LFT_PTR(NODE(root))), node, lft, (word_t*)LFT_PTR(NODE(root)));
+    }
+}
+
+// join two trees, all nodes of lft before those of rgt
+static word_t tree_merge(word_t lft, word_t rgt) {
+    if (lft == BDR_OFF) return rgt;
+    if (rgt == BDR_OFF) return lft;
+    if (PRIO(lft) > PRIO(rgt)) {
+        SET(RGT_PTR(NODE(lft)), tree_merge(GET(RGT_PTR(NODE(lft))), rgt));
+        return lft;
+    }
+    SET(LFT_PTR(NODE(rgt)), tree_merge(lft, GET(LFT_PTR(NODE(rgt)))));
+    return rgt;
+}
+
+static word_t tree_insert(word_t root, void *node) {
+    word_t off = PTR_DIFF(node, heap_base);
+    if (root == BDR_OFF || PRIO(off) > PRIO(root)) {
+        tree_split(root, node, (word_t*)LFT_PTR(node), (word_t*)RGT_PTR(node));
+        return off;
+    }
+    if (NODE_LESS(node, NODE(root)))
+        SET(LFT_PTR(NODE(root)), tree_insert(GET(LFT_PTR(NODE(root))), node));
+    else
+        SET(RGT_PTR(NODE(root)), tree_insert(GET(RGT_PTR(NODE(root))), node));
+    return root;
+}
 
-static void list_init(void *ptr) {
-    SET(NEX_PTR(ptr), BDR_OFF);
-    SET(PRE_PTR(ptr), BDR_OFF);
+static word_t tree_delete(word_t root, void *node) {
+    if (NODE(root) == node)
+        return tree_merge(GET(LFT_PTR(node)), GET(RGT_PTR(node)));
+    if (NODE_LESS(node, NODE(root)))
+        SET(LFT_PTR(NODE(root)), tree_delete(GET(LFT_PTR(NODE(root))), node));
+    else
+        SET(RGT_PTR(NODE(root)), tree_delete(GET(RGT_PTR(NODE(root))), node));
+    return root;
 }
 
+// best fit: the smallest node of at least size, the lowest among equals
+static void* tree_fit(word_t size) {
+    void *fit = NULL;
+    word_t off = GET(BUCK(TREE_RANK));
+    while (off != BDR_OFF) {
+        if (SIZE(NODE(off)) >= size) {
+            fit = NODE(off);
+            off = GET(LFT_PTR(fit));
+        } else {
+            off = GET(RGT_PTR(NODE(off)));
+        }
+    }
+    return fit;
+}
+
+// the head of a list is the entry whose predecessor is the prologue
 static void list_remove(void* entry, int rank) {
+    if (TREE_MIN && rank == TREE_RANK) {
+        SET(BUCK(rank), tree_delete(GET(BUCK(rank)), entry));
+        if (GET(BUCK(rank)) == BDR_OFF) MASK_CLR(rank);
+        return ;
+    }
     void *prev = LIST_PREV(entry);
     void *next = LIST_NEXT(entry);
-    if (STAT(prev) == UNUSED) 
-        SET(NEX_PTR(prev), PTR_DIFF(next, heap_base));
     if (STAT(next) == UNUSED) 
         SET(PRE_PTR(next), PTR_DIFF(prev, heap_base));
-    if (entry == LIST(rank)) 
+    if (STAT(prev) == UNUSED) 
+        SET(NEX_PTR(prev), PTR_DIFF(next, heap_base));
+    else {
         SET(BUCK(rank), PTR_DIFF(next, heap_base));
+        if (STAT(next) != UNUSED) MASK_CLR(rank);
+    }
 }
 
 static void list_push(void *entry, int rank) {
+    if (TREE_MIN && rank == TREE_RANK) {
+        SET(BUCK(rank), tree_insert(GET(BUCK(rank)), entry));
+        MASK_SET(rank);
+        return ;
+    }
     void *list = LIST(rank);
     if (STAT(list) == UNUSED) 
         SET(PRE_PTR(list), PTR_DIFF(entry, heap_base));
     SET(NEX_PTR(entry), PTR_DIFF(list, heap_base));
     SET(PRE_PTR(entry), BDR_OFF);
     SET(BUCK(rank), PTR_DIFF(entry, heap_base));
+    MASK_SET(rank);
+}
+
+// mem_sbrk is shared by the arenas, taken after the lock of an arena
+static word_t brk_busy;
+
+static void brk_lock(void) {
+    while (__atomic_exchange_n(&brk_busy, 1, __ATOMIC_ACQUIRE)) sched_yield();
+}
+
+static void brk_unlock(void) {
+    __atomic_store_n(&brk_busy, 0, __ATOMIC_RELEASE);
+}
+
+// the lock of the first arena while there is no chunk map, taken before brk
+static word_t boot_busy;
+
+static bool boot_trylock(void) {
+    return !__atomic_exchange_n(&boot_busy, 1, __ATOMIC_ACQUIRE);
+}
+
+static void boot_unlock(void) {
+    __atomic_store_n(&boot_busy, 0, __ATOMIC_RELEASE);
+}
+
+// without a chunk map all of the heap is the first arena's
+static void chunk_own(word_t lo, word_t hi) {
+    if (chunk_map == 0) return ;
+    for (word_t i = lo >> CHUNK_BITS; i <= (hi - 1) >> CHUNK_BITS; ++i)
+        MAP()->owner[i] = arena->index;
 }
 
+// grow the arena by size bytes in place, NULL if it is not at the heap end
 static void* extend(word_t size) {
-    void *ptr = mem_sbrk(size);
-    if (ptr == NULL) return NULL;
-    SET(HDR_PTR(EPI_BDR_PTR), ZIP(0, BORDER));
+    void *ptr = NULL;
+    brk_lock();
+    if (EPI_BDR_PTR == HEAP_END) {
+        ptr = mem_sbrk(size);
+        if (ptr == (void*)-1) ptr = NULL;
+        else {
+            arena->epilogue += size;
+            chunk_own(PTR_DIFF(ptr, heap_base), arena->epilogue);
+            SET(HDR_PTR(EPI_BDR_PTR), ZIP(0, BORDER | PRED_USED));
+        }
+    }
+    brk_unlock();
     return ptr;
 }
 
+// map a chunk at the next boundary, head bytes and then a free block of at
+// least size, its offset or 0; brk_lock is held
+static word_t chunk_new(word_t size, word_t head) {
+    word_t brk = PTR_DIFF(HEAP_END, heap_base);
+    word_t start = (brk + ARENA_CHUNK - 1) & ~(ARENA_CHUNK - 1);
+    size = MAX(size, ARENA_CHUNK - 2*WORD_SIZE);
+    if (mem_sbrk(start - brk + head + 2*WORD_SIZE + size) == (void*)-1) return 0;
+    SET(PTR_INCR(heap_base, start), head);
+    void *ptr = PTR_INCR(heap_base, start + head + 2*WORD_SIZE);
+    SET(HDR_PTR(ptr), ZIP(size, UNUSED | PRED_USED));
+    SET(FTR_PTR(ptr), ZIP(size, UNUSED));
+    SET(HDR_PTR(HEAP_NEXT(ptr)), ZIP(0, BORDER));
+    return start;
+}
+
+// start a new chunk for the arena, holding a free block of at least size
+static void* chunk(word_t size) {
+    brk_lock();
+    word_t start = chunk_new(size, 0);
+    if (start == 0) {
+        brk_unlock();
+        return NULL;
+    }
+    void *ptr = PTR_INCR(heap_base, start + 2*WORD_SIZE);
+    arena->epilogue = PTR_DIFF(HEAP_NEXT(ptr), heap_base);
+    chunk_own(start, arena->epilogue);
+    brk_unlock();
+    return ptr;
+}
+
+static void arena_init(arena_t *a, int idx, word_t epilogue) {
+    arena = a;
+    arena->index = idx;
+    arena->epilogue = epilogue;
+    for (int i = 0; i < MASK_NUM; ++i) MASK(i) = 0;
+    for (int i = 0; i < RANK_NUM; ++i) SET(BUCK(i), BDR_OFF);
+}
+
+// set up arena idx in a chunk of its own, its first free block listed, and
+// the chunk map with the first arena after the first one; no arena is held
+static void arena_new(int idx) {
+    bool boot = __atomic_load_n(&chunk_map, __ATOMIC_ACQUIRE) == 0;
+    while (boot && !boot_trylock()) sched_yield();
+    brk_lock();
+    if (arena_get(idx) != NULL) {
+        brk_unlock();
+        if (boot) boot_unlock();
+        return ;
+    }
+    word_t head = ARENA_HEAD + (chunk_map? 0: ALIGN(sizeof(chunk_map_t)));
+    word_t start = chunk_new(0, head);
+    if (start != 0) {
+        if (chunk_map == 0) {
+            // every chunk so far is the first arena's, index 0
+            word_t map = start + ARENA_HEAD;
+            memset(PTR_INCR(heap_base, map), 0, sizeof(chunk_map_t));
+            for (int i = 0; i < ARENA_NUM; ++i)
+                pthread_mutex_init(&((chunk_map_t*)PTR_INCR(heap_base, map))->locks[i], NULL);
+            __atomic_store_n(&chunk_map, map, __ATOMIC_RELEASE);
+        }
+        void *ptr = PTR_INCR(heap_base, start + head + 2*WORD_SIZE);
+        arena_init(PTR_INCR(heap_base, start + 2*WORD_SIZE), idx,
+            PTR_DIFF(HEAP_NEXT(ptr), heap_base));
+        chunk_own(start, arena->epilogue);
+        list_push(ptr, RANK(SIZE(ptr)));
+        __atomic_store_n(&MAP()->tables[idx], start + 2*WORD_SIZE, __ATOMIC_RELEASE);
+    }
+    brk_unlock();
+    if (boot) boot_unlock();
+}
+
 // split an UNUSED segment by size, push the rest part into free list
 static void split(void *ptr, word_t size) {
     word_t orgsize = SIZE(ptr);
     void* newptr = ptr + size;
-    SET(HDR_PTR(newptr), ZIP(orgsize - size, UNUSED));
+    SET(HDR_PTR(newptr), ZIP(orgsize - size, UNUSED | PRED_USED));
     SET(FTR_PTR(newptr), ZIP(orgsize - size, UNUSED));
     list_push(newptr, RANK(orgsize - size));
     assert(STAT(newptr) == UNUSED);
@@ -169,7 +506,7 @@ static void coalesce(void *pred_ptr, void *succ_ptr, bool sel) {
         list_remove(pred_ptr, RANK(pred_size));
     }
     word_t size = pred_size + succ_size;
-    SET(HDR_PTR(pred_ptr), ZIP(size, UNUSED));
+    SET(HDR_PTR(pred_ptr), ZIP(size, UNUSED | PRED(pred_ptr)));
     SET(FTR_PTR(pred_ptr), ZIP(size, UNUSED));
     if (sel) list_push(pred_ptr, RANK(size));
     assert(STAT(pred_ptr) == UNUSED);
@@ -179,63 +516,168 @@ static void coalesce(void *pred_ptr, void *succ_ptr, bool sel) {
 static void place(void* ptr, word_t size, bool sel) {
     word_t orgsize = SIZE(ptr);
     if (sel) list_remove(ptr, RANK(orgsize));
+    // a rest of MIN_BLK_SIZE would be a block of its own, but such splinters
+    // end up between used blocks and fragment the heap more than they save
     if (orgsize - size > MIN_BLK_SIZE) split(ptr, size);
-    else size = orgsize;
-    SET(HDR_PTR(ptr), ZIP(size, USED));
-    SET(FTR_PTR(ptr), ZIP(size, USED));
+    else {
+        size = orgsize;
+        void *next = HEAP_NEXT(ptr);
+        SET_BITS(HDR_PTR(next), PRED_USED);
+    }
+    SET(HDR_PTR(ptr), ZIP(size, USED | PRED(ptr)));
 }
 
-// first fit
+// first fit, best fit in the tree
 static void* find_fit(word_t size, int rank) {
     void *ptr;
+    if (TREE_MIN && rank == TREE_RANK) return tree_fit(size);
     for (ptr = LIST(rank); STAT(ptr) != BORDER; ptr = LIST_NEXT(ptr)) {
         if (SIZE(ptr) >= size) return ptr;
     }
     return NULL;
 }
 
+/*
+ * Thread caches: every thread keeps up to TCACHE_MAX freed blocks of each
+ * size below TC_BITS, CACHED, which the heap takes for used but free turns
+ * down as freed twice, and hands them out again without taking any lock. A full list returns TCACHE_BATCH
+ * blocks to their arenas at once. The lists of a thread are in a block of its
+ * own, taken from its arena with the first cached block and given back when
+ * the thread exits. 0 turns them off. They only start once a second
+ * thread uses the heap: a single thread has no lock contention to save, and
+ * blocks held in its caches are neither reused for other classes nor
+ * coalesced, which costs utilization.
+ */
+#ifndef TCACHE_MAX
+#define TCACHE_MAX 16
+#endif
+#define TCACHE_BATCH (TCACHE_MAX / 2)
+#define TC_BITS 9
+#define TC_NUM ((1 << TC_BITS) / ALIGNMENT)
+#define TC_NEXT(ptr) (*(void**)(ptr))
+
+static word_t heap_epoch;   // bumped by mm_init, caches of older heaps are dropped
+static word_t heap_threads; // threads that used the current heap
+static pthread_key_t tc_key;
+static pthread_once_t tc_once = PTHREAD_ONCE_INIT;
+
+typedef struct {
+    void *list[TC_NUM];
+    int count[TC_NUM];
+} tcache_t;
+
+static __thread tcache_t *tc;   // valid while tc_epoch is the heap's
+static __thread word_t tc_epoch;
+static __thread word_t thread_epoch;
+
 /*
  * mm_init - Called when a new trace starts.
  */
 int mm_init(void) {
-    border_offset = ALIGN(RANK_NUM * WORD_SIZE) + WORD_SIZE;
+    border_offset = ALIGN(sizeof(arena_t)) + WORD_SIZE;
     word_t size = BDR_OFF + WORD_SIZE;
     heap_base = mem_sbrk(size);
-    if (heap_base == NULL) return -1;
-    for (int i = 0; i < RANK_NUM; ++i) SET(BUCK(i), BDR_OFF);
+    if (heap_base == (void*)-1) return -1;
+    ++heap_epoch;
+    heap_threads = 0;
+    chunk_map = 0;
+    boot_busy = 0;
+    // the first arena starts out with the prologue, which ends all free lists
+    arena_init(heap_base, 0, size);
     SET(HDR_PTR(PRO_BDR_PTR), ZIP(WORD_SIZE, BORDER));
     // assert(SIZE(PRO_BDR_PTR) == WORD_SIZE);
-    SET(HDR_PTR(EPI_BDR_PTR), ZIP(0, BORDER));
+    SET(HDR_PTR(EPI_BDR_PTR), ZIP(0, BORDER | PRED_USED));
     // assert(SIZE(PRO_BDR_PTR) == WORD_SIZE);
     return 0;
 }
 
+// how the calling thread holds `arena`
+#define HELD_NONE 0
+#define HELD_BOOT 1
+#define HELD_MUTEX 2
+static __thread byte_t held;
+
+// lock arena a, or only try to unless wait; false if it is busy
+static bool arena_take(arena_t *a, bool wait) {
+    held = HELD_NONE;
+    while (!__libc_single_threaded &&
+        __atomic_load_n(&chunk_map, __ATOMIC_ACQUIRE) == 0) {
+        if (boot_trylock()) {
+            // the map may have come out while boot_busy was waited for
+            if (__atomic_load_n(&chunk_map, __ATOMIC_ACQUIRE) == 0) {
+                held = HELD_BOOT;
+                break;
+            }
+            boot_unlock();
+        } else if (!wait) return false;
+        else sched_yield();
+    }
+    if (!__libc_single_threaded && held == HELD_NONE) {
+        pthread_mutex_t *lock = &MAP()->locks[a->index];
+        if (wait) pthread_mutex_lock(lock);
+        else if (pthread_mutex_trylock(lock) != 0) return false;
+        held = HELD_MUTEX;
+    }
+    arena = a;
+    return true;
+}
+
+static void arena_lock(arena_t *a) {
+    arena_take(a, true);
+}
+
+static void arena_unlock(void) {
+    if (held == HELD_MUTEX) pthread_mutex_unlock(&MAP()->locks[arena->index]);
+    else if (held == HELD_BOOT) boot_unlock();
+    held = HELD_NONE;
+}
+
 /*
- * malloc - Allocate a block by incrementing the brk pointer.
- *      Always allocate a block whose size is a multiple of the alignment.
+ * Lock the arena of the calling thread, binding it to the next arena
+ * round-robin on its first call and setting that one up if needed. A thread
+ * finding its arena locked takes the first free one after it instead, and
+ * stays there.
  */
-void *malloc(size_t size) {
-    dbg_inc();
-
-    if (size == 0) return NULL;
-    size = MAX(ALIGN(size + META_SIZE), MIN_BLK_SIZE);
+static __thread int home = -1;
+static word_t arena_next;
+
+static void arena_acquire(void) {
+    if (home < 0)
+        home = __atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED) % ARENA_NUM;
+    if (arena_get(home) == NULL) arena_new(home);
+    for (int i = 0; i < ARENA_NUM; ++i) {
+        arena_t *a = arena_get((home + i) % ARENA_NUM);
+        if (a != NULL && arena_take(a, false)) {
+            home = a->index;
+            return ;
+        }
+    }
+    // only the first arena is there for sure, when the heap is full
+    arena_lock(arena_get(home)? arena_get(home): arena_get(0));
+}
 
-    void *ptr;
+// allocate a block of size bytes from the locked arena
+static void* heap_alloc(word_t size) {
+    // blocks in the classes above that of size are all large enough
     int rank = RANK(size);
-    do {
+    void *ptr = find_fit(size, rank);
+    if (ptr == NULL && (rank = next_rank(rank + 1)) < RANK_NUM)
         ptr = find_fit(size, rank);
-    } 
-    while(ptr == NULL && (rank += STP_BLK_BITS) < RANK_NUM);
-
 
-    dbg_printf("#%d [malloc] size %ld, rank %d, ", count, size, rank);
+    dbg_printf("#%d [malloc] size %d, rank %d, ", count, size, rank);
     if (ptr == NULL) {
-        ptr = extend(size);
+        // a free block at the end of the arena only has to be grown
+        word_t tail = PRED(EPI_BDR_PTR)? 0: 
+            SIZE(HEAP_PREV(EPI_BDR_PTR));
+        ptr = PTR_INCR(EPI_BDR_PTR, -tail);
         dbg_printf("fit NULL(%p)\n", ptr);
-        if (ptr == NULL) return NULL;
-        SET(HDR_PTR(ptr), ZIP(size, USED));
-        SET(FTR_PTR(ptr), ZIP(size, USED));
-        list_init(ptr);
+        if (extend(size - tail) != NULL) {
+            if (tail) list_remove(ptr, RANK(tail));
+            SET(HDR_PTR(ptr), ZIP(size, USED | PRED(ptr)));
+        } else {
+            if ((ptr = chunk(size)) == NULL) return NULL;
+            place(ptr, size, false);
+        }
     } else {
         dbg_printf("fit %d\n", PTR_DIFF(ptr, heap_base));
         list_remove(ptr, rank);
@@ -245,38 +687,144 @@ void *malloc(size_t size) {
     return ptr;
 }
 
-/*
- * free - Deallocate a block, try coalescing its adjacent blocks, 
-        and add it into free list.
-        We simply check the validity of the provided pointer, 
-        and will do nothing if we determine it as invalid.
- */
-void free(void *ptr) {
-    dbg_inc();
-
-    if (ptr == NULL || STAT(ptr) != USED) return ;
+// return a used or cached block to its arena, which is locked
+static void heap_free(void *ptr) {
     word_t size = SIZE(ptr);
-	list_push(ptr, RANK(size));
-    SET(HDR_PTR(ptr), ZIP(size, UNUSED));
-    SET(FTR_PTR(ptr), ZIP(size, UNUSED));
-    assert(STAT(ptr) == UNUSED);
 
     dbg_printf("#%d [free] ptr (%p, %d), size %d, rank %d\n", 
-        count, ptr, PTR_DIFF(ptr, heap_base), SIZE(ptr), RANK(SIZE(ptr)));
+        count, ptr, PTR_DIFF(ptr, heap_base), size, RANK(size));
 
-    void *prev = HEAP_PREV(ptr);
+    // merge the free neighbours first so that the block is listed only once,
+    // the footer of the block before is only there if it is free
     void *next = HEAP_NEXT(ptr);
     
     if (STAT(next) == UNUSED) {
         dbg_printf("coalesce next %d %d\n", 
             PTR_DIFF(ptr, heap_base), PTR_DIFF(next, heap_base));
-        coalesce(ptr, next, true);
+        list_remove(next, RANK(SIZE(next)));
+        size += SIZE(next);
     }
-    if (STAT(prev) == UNUSED) {
+    if (!PRED(ptr)) {
+        void *prev = HEAP_PREV(ptr);
         dbg_printf("coalesce prev %d %d\n", 
             PTR_DIFF(prev, heap_base), PTR_DIFF(ptr, heap_base));
-        coalesce(prev, ptr, true);
+        list_remove(prev, RANK(SIZE(prev)));
+        size += SIZE(prev);
+        ptr = prev;
+    }
+    SET(HDR_PTR(ptr), ZIP(size, UNUSED | PRED_USED));
+    SET(FTR_PTR(ptr), ZIP(size, UNUSED));
+    next = HEAP_NEXT(ptr);
+    CLR_BITS(HDR_PTR(next), PRED_USED);
+    list_push(ptr, RANK(size));
+    assert(STAT(ptr) == UNUSED);
+}
+
+// return the first n blocks of a thread cache list to their arenas
+static void tc_flush(int idx, int n) {
+    arena_t *locked = NULL;
+    for (; n > 0; --n) {
+        void *ptr = tc->list[idx];
+        tc->list[idx] = TC_NEXT(ptr);
+        --tc->count[idx];
+        if (OWNER(ptr) != locked) {
+            if (locked) arena_unlock();
+            arena_lock(locked = OWNER(ptr));
+        }
+        heap_free(ptr);
     }
+    if (locked) arena_unlock();
+}
+
+static void tc_exit(void *arg) {
+    (void)arg;
+    if (tc_epoch != heap_epoch) return;
+    for (int i = 0; i < TC_NUM; ++i) tc_flush(i, tc->count[i]);
+    arena_lock(OWNER(tc));
+    heap_free(tc);
+    arena_unlock();
+    tc_epoch = 0;
+}
+
+static void tc_key_init(void) {
+    pthread_key_create(&tc_key, tc_exit);
+}
+
+// count the calling thread in the current heap, true once there are two
+static bool tc_enabled(void) {
+    if (thread_epoch != heap_epoch) {
+        thread_epoch = heap_epoch;
+        __atomic_fetch_add(&heap_threads, 1, __ATOMIC_RELAXED);
+    }
+    return __atomic_load_n(&heap_threads, __ATOMIC_RELAXED) > 1;
+}
+
+// forget a cache of a heap that was reset and take one in this heap, which
+// is flushed on exit; false if the heap is full
+static bool tc_check(void) {
+    if (tc_epoch == heap_epoch) return true;
+    arena_acquire();
+    tc = heap_alloc(ALIGN(sizeof(tcache_t) + META_SIZE));
+    arena_unlock();
+    if (tc == NULL) return false;
+    memset(tc, 0, sizeof(tcache_t));
+    tc_epoch = heap_epoch;
+    pthread_once(&tc_once, tc_key_init);
+    pthread_setspecific(tc_key, &tc_epoch);
+    return true;
+}
+
+/*
+ * malloc - Allocate a block from the thread cache, or from an arena.
+ *      Always allocate a block whose size is a multiple of the alignment.
+ */
+void *malloc(size_t size) {
+    dbg_inc();
+
+    // no block of 1 << HEAP_BITS bytes fits in the heap, nor has a class
+    if (size == 0 || size >= (1u << HEAP_BITS)) return NULL;
+    size = MAX(ALIGN(size + META_SIZE), MIN_BLK_SIZE);
+
+    word_t idx = size / ALIGNMENT;
+    if (TCACHE_MAX && tc_enabled() && idx < TC_NUM &&
+        tc_epoch == heap_epoch && tc->list[idx]) {
+        void *ptr = tc->list[idx];
+        tc->list[idx] = TC_NEXT(ptr);
+        --tc->count[idx];
+        SET_BITS(HDR_PTR(ptr), USED);
+        return ptr;
+    }
+    arena_acquire();
+    void *ptr = heap_alloc(size);
+    arena_unlock();
+    return ptr;
+}
+
+/*
+ * free - Deallocate a block into the thread cache, or back to its arena,
+        where it is coalesced with its adjacent blocks and added into the
+        free list.
+        We simply check the validity of the provided pointer, 
+        and will do nothing if we determine it as invalid.
+ */
+void free(void *ptr) {
+    dbg_inc();
+
+    // the size and status of a used block only change with its owner, a
+    // block in a thread cache is CACHED and not freed again
+    if (ptr == NULL || STAT(ptr) != USED) return ;
+    word_t idx = SIZE(ptr) / ALIGNMENT;
+    if (TCACHE_MAX && tc_enabled() && idx < TC_NUM && tc_check()) {
+        if (tc->count[idx] == TCACHE_MAX) tc_flush(idx, TCACHE_BATCH);
+        CLR_BITS(HDR_PTR(ptr), USED);
+        TC_NEXT(ptr) = tc->list[idx];
+        tc->list[idx] = ptr;
+        ++tc->count[idx];
+        return ;
+    }
+    arena_lock(OWNER(ptr));
+    heap_free(ptr);
+    arena_unlock();
 }
 
 /*
@@ -298,6 +846,7 @@ void *realloc(void *oldptr, size_t size) {
     if (oldptr == NULL) {
         return malloc(size);
     }
+    if (size >= (1u << HEAP_BITS)) return NULL;
 
     word_t orgsize = size;
     word_t oldsize = SIZE(oldptr);
@@ -306,6 +855,7 @@ void *realloc(void *oldptr, size_t size) {
     /* If the original block is large enough. */
     if (oldsize >= size) return oldptr;
 
+    arena_lock(OWNER(oldptr));
     /* Try to extend segment by coalescing. */
     void *next = HEAP_NEXT(oldptr);
     word_t nexsize;
@@ -315,12 +865,22 @@ void *realloc(void *oldptr, size_t size) {
         coalesce(oldptr, next, false);
         // 'place' implies the block is removed from the free list
         place(oldptr, size, false);
+        arena_unlock();
         return oldptr;
     }
+
+    /* Or grow it in place at the end of the heap. */
+    if (next == EPI_BDR_PTR && extend(size - oldsize) != NULL) {
+        SET(HDR_PTR(oldptr), ZIP(size, USED | PRED(oldptr)));
+        arena_unlock();
+        return oldptr;
+    }
+    arena_unlock();
     
     /* Otherwise we have to allocate a new segment, and copy the original data. */
     void *newptr = malloc(orgsize);
-    memcpy(newptr, oldptr, orgsize);
+    if (newptr == NULL) return NULL;
+    memcpy(newptr, oldptr, MIN(orgsize, oldsize - META_SIZE));
     free(oldptr);
     return newptr;
 }
@@ -336,6 +896,19 @@ void *calloc (size_t nmemb, size_t size) {
     return newptr;
 }
 
+// count the nodes of a tree, checking their order and heap property
+static int tree_check(word_t root, void *lo, void *hi) {
+    if (root == BDR_OFF) return 0;
+    void *node = NODE(root);
+    assert(STAT(node) == UNUSED && RANK(SIZE(node)) == TREE_RANK);
+    assert(lo == NULL || NODE_LESS(lo, node));
+    assert(hi == NULL || NODE_LESS(node, hi));
+    word_t lft = GET(LFT_PTR(node)), rgt = GET(RGT_PTR(node));
+    assert(lft == BDR_OFF || PRIO(lft) <= PRIO(root));
+    assert(rgt == BDR_OFF || PRIO(rgt) <= PRIO(root));
+    return 1 + tree_check(lft, lo, node) + tree_check(rgt, node, hi);
+}
+
 /*
  * mm_checkheap - There are no bugs in my code, so I don't need to check,
  *      so nah!
@@ -345,33 +918,61 @@ void mm_checkheap(int verbose){
     dbg_printf("\n\n");
 	dbg_printf("=============== start ================\n");
     dbg_printf("heap size %ld\n", mem_heapsize());
-    dbg_printf("[check buckets]\n");
-    for (int i = 0; i < RANK_NUM; ++i) dbg_printf("%d ", GET(BUCK(i)));
-    dbg_printf("\n");
     dbg_printf("[check border]\n");
     dbg_printf("prologue %d %s %s\n", PTR_DIFF(PRO_BDR_PTR, heap_base), 
         (STAT(PRO_BDR_PTR) == BORDER)? "yes": "no", 
         (SIZE(PRO_BDR_PTR) == WORD_SIZE)? "yes": "no");
-    dbg_printf("epilogue %d %s %s\n", PTR_DIFF(EPI_BDR_PTR, heap_base), 
-        (STAT(EPI_BDR_PTR) == BORDER)? "yes": "no",
-        (SIZE(EPI_BDR_PTR) == 0)? "yes": "no");
     dbg_printf("[check blocks - heap]\n");
-    int cnt1 = 50;
+    // every chunk but the last ends where the heap ended when the next began
     void *ptr = PTR_INCR(PRO_BDR_PTR, WORD_SIZE);
-    for (; STAT(ptr) != BORDER && --cnt1 > 0; ptr = HEAP_NEXT(ptr)) {
-        dbg_printf("%d(%d,%d|%d,%d) ", PTR_DIFF(ptr, heap_base), 
-            SIZE(ptr), STAT(ptr), UNZIP_SIZE(FTR_PTR(ptr)), UNZIP_STAT(FTR_PTR(ptr)));
+    while (1) {
+        arena_t *owner = OWNER(ptr);
+        dbg_printf("chunk %d, arena %d: ", PTR_DIFF(ptr, heap_base), owner->index);
+        int cnt1 = 50;
+        for (; STAT(ptr) != BORDER; ptr = HEAP_NEXT(ptr)) {
+            assert(!PRED(HEAP_NEXT(ptr)) == (STAT(ptr) == UNUSED));
+            assert(OWNER(ptr) == owner);
+            if (--cnt1 <= 0) continue;
+            if (STAT(ptr) == UNUSED) {
+                dbg_printf("%d(%d,%d|%d,%d) ", PTR_DIFF(ptr, heap_base), 
+                    SIZE(ptr), STAT(ptr), UNZIP_SIZE(FTR_PTR(ptr)), UNZIP_STAT(FTR_PTR(ptr)));
+            } else {
+                dbg_printf("%d(%d,%d) ", PTR_DIFF(ptr, heap_base), SIZE(ptr), STAT(ptr));
+            }
+        }
+        dbg_printf("\n");
+        assert(SIZE(ptr) == 0);
+        if (ptr == HEAP_END) break;
+        word_t end = PTR_DIFF(ptr, heap_base);
+        word_t start = (end + ARENA_CHUNK - 1) & ~(ARENA_CHUNK - 1);
+        ptr = PTR_INCR(heap_base, start + GET(PTR_INCR(heap_base, start)) + 2*WORD_SIZE);
     }
-    dbg_printf("\n");
     dbg_printf("[check blocks - list]\n");
-    for (int i = 0; i < RANK_NUM; ++i) {
-        dbg_printf("rank %02d: ", i);
-        int cnt2 = 50;
-        for (void *ptr = LIST(i); STAT(ptr) != BORDER && --cnt2 > 0; ptr = LIST_NEXT(ptr)) {
-            dbg_printf("%d(%d,%d) ", PTR_DIFF(ptr, heap_base), SIZE(ptr), STAT(ptr));
-            assert(STAT(ptr) == UNUSED);
+    for (int k = 0; k < ARENA_NUM; ++k) {
+        if ((arena = arena_get(k)) == NULL) continue;
+        assert(arena->index == (word_t)k);
+        for (int i = 0; i < RANK_NUM; ++i) {
+            assert(!(MASK(i >> 6) >> (i & 63) & 1) == (STAT(LIST(i)) == BORDER));
+            if (STAT(LIST(i)) == BORDER) continue;
+            if (TREE_MIN && i == TREE_RANK) {
+                assert(tree_check(GET(BUCK(i)), NULL, NULL) > 0);
+                continue;
+            }
+            dbg_printf("rank %02d: ", i);
+            int cnt2 = 50;
+            for (void *ptr = LIST(i); STAT(ptr) != BORDER && --cnt2 > 0; ptr = LIST_NEXT(ptr)) {
+                dbg_printf("%d(%d,%d) ", PTR_DIFF(ptr, heap_base), SIZE(ptr), STAT(ptr));
+                assert(STAT(ptr) == UNUSED && OWNER(ptr) == arena);
+            }
+            dbg_printf("\n");
         }
-        dbg_printf("\n");
+    }
+    dbg_printf("[check blocks - thread cache]\n");
+    for (int i = 0; TCACHE_MAX && tc_epoch == heap_epoch && i < TC_NUM; ++i) {
+        int cnt3 = 0;
+        for (void *ptr = tc->list[i]; ptr != NULL; ptr = TC_NEXT(ptr), ++cnt3)
+            assert(STAT(ptr) == CACHED && SIZE(ptr) / ALIGNMENT == (word_t)i);
+        assert(cnt3 == tc->count[i]);
     }
     dbg_printf("===============  end  ================\n");
     dbg_printf("\n\n");